@@ -0,0 +1,164 @@
+# include "ata.h"
+# include "io.h"
+# include "kernel/print.h"
+# include "thread/sync.h"
+# include "debug.h"
+
+// 主通道的端口，bochs配置中ata0的ioaddr1和ioaddr2
+# define ATA_REG_DATA 0x1f0
+# define ATA_REG_ERROR 0x1f1
+# define ATA_REG_SECT_CNT 0x1f2
+# define ATA_REG_LBA_LOW 0x1f3
+# define ATA_REG_LBA_MID 0x1f4
+# define ATA_REG_LBA_HIGH 0x1f5
+# define ATA_REG_DEVICE 0x1f6
+// 读为状态寄存器，写为命令寄存器
+# define ATA_REG_STATUS 0x1f7
+# define ATA_REG_CMD 0x1f7
+# define ATA_REG_CTRL 0x3f6
+
+// 状态寄存器
+# define ATA_STATUS_BSY 0x80
+# define ATA_STATUS_DRDY 0x40
+# define ATA_STATUS_DRQ 0x08
+# define ATA_STATUS_ERR 0x01
+
+// device寄存器: 第7和第5位固定为1，第6位为1表示LBA模式，第4位为0表示主盘
+# define ATA_DEVICE_MBS 0xa0
+# define ATA_DEVICE_LBA 0x40
+
+// 控制寄存器: 关闭硬盘中断，驱动以轮询的方式工作
+# define ATA_CTRL_NIEN 0x02
+
+# define ATA_CMD_READ 0x20
+# define ATA_CMD_WRITE 0x30
+# define ATA_CMD_FLUSH 0xe7
+# define ATA_CMD_IDENTIFY 0xec
+
+// LBA28最多可以寻址的扇区数
+# define ATA_LBA28_MAX 0x10000000
+// 轮询状态寄存器的最大次数，超过视为硬盘无响应
+# define ATA_POLL_MAX 1000000
+
+// 硬盘的扇区总数，为0表示没有硬盘
+static uint32_t sector_count;
+// 同一时刻只能有一个任务操作通道的端口
+static struct lock ata_lock;
+
+/**
+ * 等待硬盘不忙，mask中的位全部置位时返回0，出错或超时返回-1.
+ */ 
+static int ata_wait(uint8_t mask) {
+    uint32_t poll = 0;
+    while (poll++ < ATA_POLL_MAX) {
+        uint8_t status = inb(ATA_REG_STATUS);
+        if (status & ATA_STATUS_BSY) {
+            continue;
+        }
+
+        if (status & ATA_STATUS_ERR) {
+            return -1;
+        }
+        if ((status & mask) == mask) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * 写入起始扇区、扇区数并发出命令.
+ */ 
+static void ata_cmd_send(uint32_t lba, uint8_t sec_cnt, uint8_t cmd) {
+    outb(ATA_REG_SECT_CNT, sec_cnt);
+    outb(ATA_REG_LBA_LOW, lba);
+    outb(ATA_REG_LBA_MID, lba >> 8);
+    outb(ATA_REG_LBA_HIGH, lba >> 16);
+    outb(ATA_REG_DEVICE, ATA_DEVICE_MBS | ATA_DEVICE_LBA | ((lba >> 24) & 0x0f));
+    outb(ATA_REG_CMD, cmd);
+}
+
+/**
+ * 初始化主通道的主盘，通过identify命令获取扇区数.
+ */ 
+void ata_init(void) {
+    put_str("ata_init start.\n");
+    lock_init(&ata_lock);
+    outb(ATA_REG_CTRL, ATA_CTRL_NIEN);
+
+    sector_count = 0;
+    outb(ATA_REG_DEVICE, ATA_DEVICE_MBS);
+    outb(ATA_REG_CMD, ATA_CMD_IDENTIFY);
+
+    // 状态为0表示主盘不存在，0xff表示通道上没有设备
+    uint8_t status = inb(ATA_REG_STATUS);
+    if (status != 0 && status != 0xff && ata_wait(ATA_STATUS_DRQ) == 0) {
+        uint16_t identify[256];
+        insw(ATA_REG_DATA, identify, 256);
+        // 第60、61字为LBA28模式下可寻址的扇区数
+        sector_count = identify[60] | ((uint32_t) identify[61] << 16);
+    }
+
+    put_str("ata0-master sectors: ");
+    put_int(sector_count);
+    put_str("\nata_init done.\n");
+}
+
+uint32_t ata_sector_count(void) {
+    return sector_count;
+}
+
+/**
+ * 从lba处读取sec_cnt个扇区到buf，sec_cnt为0表示256个. 以轮询的方式等待，成功返回0，失败返回-1.
+ */ 
+int ata_read(uint32_t lba, void* buf, uint8_t sec_cnt) {
+    uint32_t secs = (sec_cnt == 0 ? 256 : sec_cnt), i;
+    ASSERT(lba + secs <= ATA_LBA28_MAX);
+
+    lock_acquire(&ata_lock);
+
+    int ret = ata_wait(ATA_STATUS_DRDY);
+    if (ret == 0) {
+        ata_cmd_send(lba, sec_cnt, ATA_CMD_READ);
+        for (i = 0; i < secs && ret == 0; i++) {
+            // 每个扇区准备好之后才能读取
+            ret = ata_wait(ATA_STATUS_DRQ);
+            if (ret == 0) {
+                insw(ATA_REG_DATA, (uint8_t*) buf + i * SECTOR_SIZE, SECTOR_SIZE / 2);
+            }
+        }
+    }
+
+    lock_release(&ata_lock);
+    return ret;
+}
+
+/**
+ * 将buf中的sec_cnt个扇区写入lba处，sec_cnt为0表示256个，写完后刷新硬盘的缓存. 成功返回0，失败返回-1.
+ */ 
+int ata_write(uint32_t lba, const void* buf, uint8_t sec_cnt) {
+    uint32_t secs = (sec_cnt == 0 ? 256 : sec_cnt), i;
+    ASSERT(lba + secs <= ATA_LBA28_MAX);
+
+    lock_acquire(&ata_lock);
+
+    int ret = ata_wait(ATA_STATUS_DRDY);
+    if (ret == 0) {
+        ata_cmd_send(lba, sec_cnt, ATA_CMD_WRITE);
+        for (i = 0; i < secs && ret == 0; i++) {
+            ret = ata_wait(ATA_STATUS_DRQ);
+            if (ret == 0) {
+                outsw(ATA_REG_DATA, (const uint8_t*) buf + i * SECTOR_SIZE, SECTOR_SIZE / 2);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        outb(ATA_REG_CMD, ATA_CMD_FLUSH);
+        ret = ata_wait(0);
+    }
+
+    lock_release(&ata_lock);
+    return ret;
+}
@@ -0,0 +1,14 @@
+# ifndef _DEVICE_ATA_H
+# define _DEVICE_ATA_H
+
+# include "stdint.h"
+
+// 扇区大小
+# define SECTOR_SIZE 512
+
+void ata_init(void);
+uint32_t ata_sector_count(void);
+int ata_read(uint32_t lba, void* buf, uint8_t sec_cnt);
+int ata_write(uint32_t lba, const void* buf, uint8_t sec_cnt);
+
+# endif
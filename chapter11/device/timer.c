@@ -1,3 +1,4 @@
+# include "timer.h"
 # include "io.h"
 # include "kernel/print.h"
 # include "interrupt.h"
@@ -6,18 +7,188 @@
 
 # define IRQ0_FREQUENCY 1000
 # define INPUT_FREQUENCY 1193180
-# define COUNTER0_VALUE INPUT_FREQUENCY / IRQ0_FREQUENCY
+# define COUNTER0_VALUE (INPUT_FREQUENCY / IRQ0_FREQUENCY)
 # define COUNTER0_PORT 0x40
 # define COUNTER_MODE 2
+// 方式0，计数到0时产生一次中断，用于单次定时
+# define COUNTER_MODE_ONESHOT 0
 # define COUNTER0_NO 0
 # define READ_WRITE_LATCH 3
 # define PIT_CONTROL_PORT 0x43
+// 回读命令，同时锁存计数器0的状态和计数值
+# define PIT_READ_BACK_COUNTER0 0xc2
+// 状态字节中OUT引脚的电平，方式0下计数到0后变高
+# define PIT_STATUS_OUT 0x80
+// 单次定时最多跨越的嘀嗒数，受16位计数器的限制
+# define ONESHOT_MAX_TICKS (0xffff / COUNTER0_VALUE)
+// 校准TSC用的计数器2，其门控和输出位于端口0x61
+# define COUNTER2_PORT 0x42
+# define COUNTER2_NO 2
+# define PIT_GATE_PORT 0x61
+# define PIT_GATE2 0x01
+# define PC_SPEAKER 0x02
+# define PIT_OUT2 0x20
+// 校准TSC的时长(毫秒)
+# define CALIBRATE_MS 10
+// 等待计数器2到0时最多读端口的次数，每次读ISA端口约1微秒，远长于CALIBRATE_MS
+# define CALIBRATE_POLL_MAX 1000000
+
+// 时间轮: 第1级256个槽，每槽一个嘀嗒; 其后4级各64个槽，每槽的跨度依次扩大64倍，合起来覆盖32位的嘀嗒数
+# define TVR_BITS 8
+# define TVN_BITS 6
+# define TVR_SIZE (1 << TVR_BITS)
+# define TVN_SIZE (1 << TVN_BITS)
+# define TVR_MASK (TVR_SIZE - 1)
+# define TVN_MASK (TVN_SIZE - 1)
+# define TVN_LEVELS 4
 
 /**
  * 内核自开启中断后所有的嘀嗒数.
  */
 uint32_t ticks;
 
+static struct list tv1[TVR_SIZE];
+static struct list tvn[TVN_LEVELS][TVN_SIZE];
+// 时间轮已处理到的嘀嗒数，每个时钟中断追上ticks
+static uint32_t wheel_ticks;
+// 单次定时跨越的嘀嗒数，0表示PIT处于周期模式
+static uint32_t oneshot_ticks;
+// 提前结束单次定时时不足一个嘀嗒的计数，累计到下一次提前结束时
+static uint32_t oneshot_remainder;
+// 实际发生的时钟中断次数
+static uint32_t timer_irqs;
+// TSC每毫秒的周期数，0表示校准失败，此时时间只能精确到嘀嗒
+static uint32_t tsc_khz;
+// 校准完成时的TSC，单调时间的起点
+static uint64_t tsc_boot;
+
+/**
+ * 按到期时间与当前时间的距离把定时器挂到对应级别的槽中，O(1). 需要关中断调用.
+ */ 
+static void wheel_insert(struct timer* t) {
+    uint32_t expires = t->expires, idx = expires - wheel_ticks;
+    struct list* slot;
+
+    if ((int32_t) idx < 0) {
+        // 已经过期，下一个嘀嗒处理
+        slot = &tv1[wheel_ticks & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        slot = &tv1[expires & TVR_MASK];
+    } else {
+        uint32_t level = 0;
+        while (level < TVN_LEVELS - 1 && idx >= (1u << (TVR_BITS + (level + 1) * TVN_BITS))) {
+            ++level;
+        }
+        slot = &tvn[level][(expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+    }
+
+    list_append(slot, &t->tag);
+}
+
+/**
+ * 把第level级当前槽中的定时器重新分散到更低的级别，返回槽下标，为0时上一级也需要迁移.
+ */ 
+static uint32_t wheel_cascade(uint32_t level) {
+    uint32_t index = (wheel_ticks >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+    struct list* slot = &tvn[level][index];
+
+    while (!list_empty(slot)) {
+        wheel_insert(elem2entry(struct timer, tag, list_pop(slot)));
+    }
+    return index;
+}
+
+/**
+ * 推进时间轮直到ticks，依次调用到期定时器的回调函数. 每个定时器最多迁移TVN_LEVELS次，分摊下来为O(1).
+ */ 
+static void wheel_run(void) {
+    while ((int32_t) (ticks - wheel_ticks) >= 0) {
+        uint32_t index = wheel_ticks & TVR_MASK, level = 0;
+        // 第1级转完一圈，从上一级取出接下来256个嘀嗒内到期的定时器
+        if (index == 0) {
+            while (level < TVN_LEVELS && wheel_cascade(level) == 0) {
+                ++level;
+            }
+        }
+        ++wheel_ticks;
+
+        struct list* slot = &tv1[index];
+        while (!list_empty(slot)) {
+            struct timer* t = elem2entry(struct timer, tag, list_pop(slot));
+            // 先摘下再回调，回调中可以重新添加此定时器
+            t->pending = 0;
+            t->func(t->arg);
+        }
+    }
+}
+
+/**
+ * 初始化定时器，func为到期时的回调函数.
+ */ 
+void timer_setup(struct timer* t, void (*func) (void* arg), void* arg) {
+    t->func = func;
+    t->arg = arg;
+    t->pending = 0;
+}
+
+/**
+ * 使定时器在嘀嗒数到达expires时到期，已在等待的定时器改为新的到期时间.
+ */ 
+void timer_add(struct timer* t, uint32_t expires) {
+    enum intr_status old_status = intr_disable();
+
+    // 新的定时器可能早于单次定时的结束时间
+    timer_tickless_exit();
+
+    if (t->pending) {
+        list_remove(&t->tag);
+    }
+    t->expires = expires;
+    t->pending = 1;
+    wheel_insert(t);
+
+    intr_set_status(old_status);
+}
+
+/**
+ * 取消定时器，返回其是否还在等待到期.
+ */ 
+int timer_cancel(struct timer* t) {
+    enum intr_status old_status = intr_disable();
+
+    int pending = t->pending;
+    if (pending) {
+        list_remove(&t->tag);
+        t->pending = 0;
+    }
+
+    intr_set_status(old_status);
+    return pending;
+}
+
+/**
+ * 睡眠定时器到期，唤醒睡眠的线程.
+ */ 
+static void sleep_timeout(void* arg) {
+    thread_unblock((struct task_struct*) arg);
+}
+
+/**
+ * 使当前线程睡眠至少m_seconds毫秒，期间不占用CPU. 毫秒数向上取整为嘀嗒数后再加一个嘀嗒，
+ * 因为当前的嘀嗒已经过去了一部分，下一次时钟中断可能马上到来.
+ */ 
+void mtime_sleep(uint32_t m_seconds) {
+    // 定时器位于栈上，到期前线程一直阻塞，不会被销毁
+    struct timer t;
+    timer_setup(&t, sleep_timeout, running_thread());
+
+    enum intr_status old_status = intr_disable();
+    uint32_t sleep_ticks = (uint32_t) div_u64_rem((uint64_t) m_seconds * IRQ0_FREQUENCY + 999, 1000, NULL) + 1;
+    timer_add(&t, ticks + sleep_ticks);
+    thread_block(TASK_BLOCKED);
+    intr_set_status(old_status);
+}
+
 static void frequency_set(uint8_t counter_port,
                           uint8_t counter_no,
                           uint8_t rwl,
@@ -25,7 +196,75 @@ static void frequency_set(uint8_t counter_port,
                           uint16_t counter_value) {
     outb(PIT_CONTROL_PORT, (uint8_t) (counter_no << 6 | rwl << 4 | counter_mode << 1));
     outb(counter_port, (uint8_t) counter_value);
-    outb(counter_port, (uint8_t) counter_value >> 8);
+    outb(counter_port, (uint8_t) (counter_value >> 8));
+}
+
+/**
+ * 在max个嘀嗒内找到时间轮中最近一个需要处理的嘀嗒，返回距今的嘀嗒数，没有则返回max.
+ */ 
+static uint32_t wheel_next_event(uint32_t max) {
+    uint32_t k;
+    for (k = 0; k < max; k++) {
+        uint32_t index = (wheel_ticks + k) & TVR_MASK;
+        // 下标为0时要从上一级迁移定时器，其中可能有当时到期的
+        if (index == 0 || !list_empty(&tv1[index])) {
+            return k + 1;
+        }
+    }
+    return max;
+}
+
+/**
+ * 时间过去了elapsed个嘀嗒，推进ticks和时间轮. 当前任务的时间片由时钟中断处理扣除，提前结束单次定时时不扣.
+ */ 
+static void ticks_advance(uint32_t elapsed) {
+    ticks += elapsed;
+    wheel_run();
+}
+
+/**
+ * 提前结束单次定时: 根据计数器已走过的计数补上嘀嗒数，不足一个嘀嗒的部分留到下一次，PIT恢复周期模式. 需要关中断调用.
+ * 计数已经到0时中断随后就会到来，此时什么也不做，由中断处理补上全部嘀嗒.
+ */ 
+void timer_tickless_exit(void) {
+    if (oneshot_ticks == 0) {
+        return;
+    }
+
+    outb(PIT_CONTROL_PORT, PIT_READ_BACK_COUNTER0);
+    uint8_t status = inb(COUNTER0_PORT);
+    uint32_t count = inb(COUNTER0_PORT);
+    count |= ((uint32_t) inb(COUNTER0_PORT) << 8);
+    if (status & PIT_STATUS_OUT) {
+        return;
+    }
+
+    // 计数值刚写入、尚未装入计数器时读到的值没有意义
+    uint32_t total = oneshot_ticks * COUNTER0_VALUE;
+    uint32_t passed = (count < total ? total - count : 0) + oneshot_remainder;
+    uint32_t elapsed = passed / COUNTER0_VALUE;
+    oneshot_remainder = passed % COUNTER0_VALUE;
+    oneshot_ticks = 0;
+    frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+    ticks_advance(elapsed);
+}
+
+/**
+ * 接下来的max个嘀嗒内若只有时间轮可能有事要做，把PIT改为单次模式，到下一个定时器到期(最多max个嘀嗒)时才产生中断.
+ * 需要关中断调用.
+ */ 
+void timer_tickless_enter(uint32_t max) {
+    timer_tickless_exit();
+    if (oneshot_ticks != 0) {
+        // 单次定时的中断已经在路上
+        return;
+    }
+
+    uint32_t n = wheel_next_event(max < ONESHOT_MAX_TICKS ? max : ONESHOT_MAX_TICKS);
+    if (n > 1) {
+        oneshot_ticks = n;
+        frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE_ONESHOT, n * COUNTER0_VALUE);
+    }
 }
 
 static void intr_timer_handler(void) {
@@ -33,14 +272,112 @@ static void intr_timer_handler(void) {
 
     ASSERT(cur_thread->stack_magic == 0x77777777);
 
-    cur_thread->elaspsed_ticks++;
-    ticks++;
+    timer_irqs++;
+    uint32_t elapsed = 1;
+    if (oneshot_ticks != 0) {
+        // 单次定时到期，先恢复周期模式
+        elapsed = oneshot_ticks;
+        oneshot_ticks = 0;
+        frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+    }
+    ticks_advance(elapsed);
 
+    // 单次定时不会超过剩余的时间片，只有期间切换了任务时才可能超过
+    cur_thread->ticks = (cur_thread->ticks > elapsed - 1 ? cur_thread->ticks - (elapsed - 1) : 0);
     if (cur_thread->ticks == 0) {
         schedule();
     } else {
         cur_thread->ticks--;
     }
+
+    // 没有其它任务可以运行，时间片用完之前不需要时钟中断
+    if (thread_alone()) {
+        timer_tickless_enter(cur_thread->ticks + 1);
+    }
+}
+
+/**
+ * 64位数除以32位数，返回64位的商，余数存入remainder(可为NULL). 内核不链接libgcc，不能直接使用64位除法.
+ */ 
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t* remainder) {
+    uint32_t high = (uint32_t) (dividend >> 32), low = (uint32_t) dividend;
+    uint32_t quot_high = high / divisor, quot_low, rem;
+
+    // 被除数的高32位小于除数，divl的商不会溢出
+    asm ("divl %4" : "=a" (quot_low), "=d" (rem) : "0" (low), "1" (high % divisor), "rm" (divisor));
+    if (remainder != NULL) {
+        *remainder = rem;
+    }
+    return (((uint64_t) quot_high << 32) | quot_low);
+}
+
+/**
+ * 用PIT计数器2定时CALIBRATE_MS毫秒，测出TSC的频率. 需要在关中断时调用.
+ * 计数器2的OUT始终不变高(如虚拟机没有模拟门控)时超时返回，tsc_khz保持为0.
+ */ 
+static void tsc_calibrate(void) {
+    // 打开计数器2的门控，关闭扬声器
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~PC_SPEAKER) | PIT_GATE2);
+    // 方式0写入计数值后OUT变低，计数到0时变高
+    frequency_set(COUNTER2_PORT, COUNTER2_NO, READ_WRITE_LATCH, COUNTER_MODE_ONESHOT, CALIBRATE_MS * (INPUT_FREQUENCY / 1000));
+
+    uint32_t polls = 0;
+    uint64_t start = rdtsc();
+    while (!(inb(PIT_GATE_PORT) & PIT_OUT2) && polls < CALIBRATE_POLL_MAX) {
+        polls++;
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    if (polls < CALIBRATE_POLL_MAX) {
+        tsc_khz = (uint32_t) div_u64_rem(cycles, CALIBRATE_MS, NULL);
+    }
+    tsc_boot = rdtsc();
+}
+
+/**
+ * 把TSC周期数换算为纳秒.
+ */ 
+uint64_t tsc_to_ns(uint64_t cycles) {
+    if (tsc_khz == 0) {
+        return 0;
+    }
+
+    uint32_t rem;
+    uint64_t ms = div_u64_rem(cycles, tsc_khz, &rem);
+    return (ms * 1000000 + div_u64_rem((uint64_t) rem * 1000000, tsc_khz, NULL));
+}
+
+/**
+ * 把TSC周期数换算为微秒.
+ */ 
+uint64_t tsc_to_us(uint64_t cycles) {
+    if (tsc_khz == 0) {
+        return 0;
+    }
+    return div_u64_rem(cycles * 1000, tsc_khz, NULL);
+}
+
+/**
+ * 返回系统启动(校准TSC)以来的纳秒数，单调递增. TSC不可用时退化为嘀嗒的精度.
+ */ 
+uint64_t clock_monotonic_ns(void) {
+    if (tsc_khz == 0) {
+        return ((uint64_t) ticks * (1000000000 / IRQ0_FREQUENCY));
+    }
+    return tsc_to_ns(rdtsc() - tsc_boot);
+}
+
+/**
+ * 打印启动以来的毫秒数、时钟的嘀嗒数以及实际发生的时钟中断次数，二者之差即单次定时省下的中断.
+ */ 
+void print_tick_stat(void) {
+    put_str("Uptime ms: ");
+    put_int((uint32_t) div_u64_rem(clock_monotonic_ns(), 1000000, NULL));
+    put_str("; ticks: ");
+    put_int(ticks);
+    put_str("; timer interrupts: ");
+    put_int(timer_irqs);
+    put_char('\n');
 }
 
 /**
@@ -48,7 +385,22 @@ static void intr_timer_handler(void) {
  */ 
 void timer_init() {
     put_str("timer_init start.\n");
+    tsc_calibrate();
+    put_str("TSC kHz: ");
+    put_int(tsc_khz);
+    put_char('\n');
     frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+    uint32_t idx, level;
+    for (idx = 0; idx < TVR_SIZE; idx++) {
+        list_init(&tv1[idx]);
+    }
+    for (level = 0; level < TVN_LEVELS; level++) {
+        for (idx = 0; idx < TVN_SIZE; idx++) {
+            list_init(&tvn[level][idx]);
+        }
+    }
+    wheel_ticks = ticks;
+
     register_handler(0x20, intr_timer_handler);
     put_str("timer_init done.\n");
 }
\ No newline at end of file
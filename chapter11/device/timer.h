@@ -1 +1,38 @@
-void timer_init();
\ No newline at end of file
+# ifndef _DEVICE_TIMER_H
+# define _DEVICE_TIMER_H
+
+# include "stdint.h"
+# include "kernel/list.h"
+
+/**
+ * 内核定时器，到期时在时钟中断中(关中断)调用func(arg).
+ */ 
+struct timer {
+    struct list_elem tag;
+    // 到期时的嘀嗒数
+    uint32_t expires;
+    void (*func) (void* arg);
+    void* arg;
+    // 是否在时间轮中等待到期
+    uint8_t pending;
+};
+
+/**
+ * 内核自开启中断后所有的嘀嗒数.
+ */
+extern uint32_t ticks;
+
+void timer_init();
+void timer_setup(struct timer* t, void (*func) (void* arg), void* arg);
+void timer_add(struct timer* t, uint32_t expires);
+int timer_cancel(struct timer* t);
+void mtime_sleep(uint32_t m_seconds);
+void timer_tickless_enter(uint32_t max);
+void timer_tickless_exit(void);
+void print_tick_stat(void);
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t* remainder);
+uint64_t tsc_to_ns(uint64_t cycles);
+uint64_t tsc_to_us(uint64_t cycles);
+uint64_t clock_monotonic_ns(void);
+
+# endif
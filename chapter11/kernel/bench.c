@@ -0,0 +1,345 @@
+# include "bench.h"
+# include "stdint.h"
+# include "global.h"
+# include "memory.h"
+# include "io.h"
+# include "timer.h"
+# include "console.h"
+# include "vmalloc.h"
+# include "interrupt.h"
+# include "thread/thread.h"
+
+/**
+ * 内核启动时的基准测试，以make all BENCH=1编译时由main在创建其它任务之前调用，此前不能有线程退出.
+ * 结果以TSC周期数打印(16进制)，同时换算为纳秒.
+ */
+
+// kmalloc测试中同时存在的对象数及重复轮数
+# define KMALLOC_OBJS 256
+# define KMALLOC_ROUNDS 16
+# define KMALLOC_SIZE 64
+
+// TLB测试的缓冲区页数及遍历次数，512个4KB页远多于TLB的表项数
+# define TLB_PAGES 512
+# define TLB_PASSES 64
+
+// 任务切换测试: 每次重新加载CR3后访问的内核页数(4KB映射)及重复次数
+# define SWITCH_PAGES 64
+# define SWITCH_ROUNDS 1024
+// CR4的全局页使能位
+# define CR4_PGE 0x00000080
+// 虚拟地址转换测试中每种方式的转换次数
+# define V2P_ROUNDS 4096
+// 创建/退出测试中一批的线程数，与PCB缓存的容量(PCB_CACHE_MAX)相同，以及热缓存下的重复批数
+# define SPAWN_BATCH 16
+# define SPAWN_ROUNDS 8
+// 调度测试中每个线程让出CPU的次数
+# define YIELD_ROUNDS 16
+// 测试线程的优先级，与main相同
+# define BENCH_PRIO 31
+
+static void* objs[KMALLOC_OBJS];
+// 已结束的测试线程数
+static volatile uint32_t bench_exited;
+
+/**
+ * 打印一项测试的结果: 平均每次操作的周期数和纳秒数.
+ */ 
+static void bench_report(char* name, uint64_t cycles, uint32_t ops) {
+    uint32_t per_op = (uint32_t) div_u64_rem(cycles, ops, NULL);
+    console_put_str(name);
+    console_put_str(": 0x");
+    console_put_int(per_op);
+    console_put_str(" cycles, 0x");
+    console_put_int((uint32_t) tsc_to_ns(per_op));
+    console_put_str(" ns\n");
+}
+
+/**
+ * 小对象分配: 同时持有KMALLOC_OBJS个64字节的对象，对比kmalloc/kfree与每个对象独占一页.
+ */ 
+static void bench_kmalloc(void) {
+    uint32_t round, i;
+    uint64_t start = rdtsc();
+    for (round = 0; round < KMALLOC_ROUNDS; round++) {
+        for (i = 0; i < KMALLOC_OBJS; i++) {
+            objs[i] = kmalloc(KMALLOC_SIZE);
+        }
+        for (i = 0; i < KMALLOC_OBJS; i++) {
+            kfree(objs[i]);
+        }
+    }
+    bench_report("kmalloc+kfree 64B", rdtsc() - start, KMALLOC_ROUNDS * KMALLOC_OBJS);
+
+    start = rdtsc();
+    for (round = 0; round < KMALLOC_ROUNDS; round++) {
+        for (i = 0; i < KMALLOC_OBJS; i++) {
+            objs[i] = malloc_page(PF_KERNEL, 1);
+        }
+        for (i = 0; i < KMALLOC_OBJS; i++) {
+            mfree_page(PF_KERNEL, objs[i], 1);
+        }
+    }
+    bench_report("one page per object", rdtsc() - start, KMALLOC_ROUNDS * KMALLOC_OBJS);
+}
+
+/**
+ * 每页读一个字，遍历TLB_PASSES次，返回总周期数. 页内偏移逐页错开一个缓存行，避免都落在同一个缓存组.
+ */ 
+static uint64_t tlb_walk(uint8_t* buf) {
+    uint32_t pass, i, sum = 0;
+    uint64_t start = rdtsc();
+    for (pass = 0; pass < TLB_PASSES; pass++) {
+        for (i = 0; i < TLB_PAGES; i++) {
+            sum += *(volatile uint32_t*) (buf + i * PAGE_SIZE + (i % 64) * 64);
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+    // 防止读操作被优化掉
+    asm volatile ("" : : "r" (sum));
+    return cycles;
+}
+
+/**
+ * 在vmalloc区逐页建立4KB映射的pg_cnt页，失败返回NULL. 先占一段地址后归还，再逐页用get_a_page映射.
+ */ 
+static uint8_t* small_pages_alloc(uint32_t pg_cnt) {
+    uint32_t vaddr = kvaddr_alloc(pg_cnt);
+    if (vaddr == 0) {
+        return NULL;
+    }
+    kvaddr_free(vaddr, pg_cnt);
+
+    uint32_t i;
+    for (i = 0; i < pg_cnt; i++) {
+        if (get_a_page(PF_KERNEL, vaddr + i * PAGE_SIZE) == NULL) {
+            if (i > 0) {
+                mfree_page(PF_KERNEL, (void*) vaddr, i);
+            }
+            return NULL;
+        }
+    }
+    return (uint8_t*) vaddr;
+}
+
+/**
+ * TLB缺失: 同样大小的内核缓冲区，分别位于直接映射区(4MB大页)和vmalloc区(逐页4KB映射)，比较跨页访问的代价.
+ */ 
+static void bench_tlb(void) {
+    uint8_t* large = get_kernel_pages(TLB_PAGES);
+    if (large == NULL || addr_v2p((uint32_t) large) != (uint32_t) large - K_VADDR_START) {
+        // 凑不出连续的物理块时get_kernel_pages会退回到vmalloc区
+        console_put_str("tlb: no direct mapped buffer, skipped\n");
+        if (large != NULL) {
+            mfree_page(PF_KERNEL, large, TLB_PAGES);
+        }
+        return;
+    }
+
+    uint8_t* small = small_pages_alloc(TLB_PAGES);
+    if (small == NULL) {
+        console_put_str("tlb: out of memory, skipped\n");
+        mfree_page(PF_KERNEL, large, TLB_PAGES);
+        return;
+    }
+
+    // 先各遍历一次，排除第一次访问缓存的影响
+    tlb_walk(large);
+    bench_report("tlb walk, 4MB pages", tlb_walk(large), TLB_PASSES * TLB_PAGES);
+    tlb_walk(small);
+    bench_report("tlb walk, 4KB pages", tlb_walk(small), TLB_PASSES * TLB_PAGES);
+
+    mfree_page(PF_KERNEL, small, TLB_PAGES);
+    mfree_page(PF_KERNEL, large, TLB_PAGES);
+}
+
+/**
+ * 原先的addr_v2p: 经页目录的自映射(0xffc00000)读出页表项，只适用于4KB映射的地址. 与addr_v2p一样以函数调用的方式执行.
+ */ 
+static __attribute__((noinline)) uint32_t v2p_pte_walk(uint32_t vaddr) {
+    uint32_t* pte = (uint32_t*) (0xffc00000 + ((vaddr & 0xffc00000) >> 10) + (((vaddr & 0x003ff000) >> 12) << 2));
+    return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
+}
+
+/**
+ * 虚拟地址转换: 直接映射区的地址由addr_v2p直接减去偏移得到，对比原先经两级页表查找4KB映射的页.
+ */ 
+static void bench_v2p(void) {
+    uint8_t* direct = get_kernel_pages(1);
+    uint8_t* small = small_pages_alloc(1);
+    if (direct == NULL || small == NULL) {
+        console_put_str("v2p: out of memory, skipped\n");
+        if (direct != NULL) {
+            mfree_page(PF_KERNEL, direct, 1);
+        }
+        if (small != NULL) {
+            mfree_page(PF_KERNEL, small, 1);
+        }
+        return;
+    }
+
+    uint32_t i, sum = 0;
+    uint64_t start = rdtsc();
+    for (i = 0; i < V2P_ROUNDS; i++) {
+        sum += addr_v2p((uint32_t) direct + (i % 64) * 64);
+    }
+    bench_report("addr_v2p, direct map", rdtsc() - start, V2P_ROUNDS);
+
+    start = rdtsc();
+    for (i = 0; i < V2P_ROUNDS; i++) {
+        sum += v2p_pte_walk((uint32_t) small + (i % 64) * 64);
+    }
+    bench_report("page table walk, 4KB page", rdtsc() - start, V2P_ROUNDS);
+    asm volatile ("" : : "r" (sum));
+
+    mfree_page(PF_KERNEL, small, 1);
+    mfree_page(PF_KERNEL, direct, 1);
+}
+
+/**
+ * 模拟进程切换: 重新加载CR3，随后访问SWITCH_PAGES个内核页，返回总周期数.
+ */ 
+static uint64_t switch_walk(uint8_t* buf) {
+    uint32_t cr3, round, i, sum = 0;
+    asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+
+    uint64_t start = rdtsc();
+    for (round = 0; round < SWITCH_ROUNDS; round++) {
+        asm volatile ("movl %0, %%cr3" : : "r" (cr3) : "memory");
+        for (i = 0; i < SWITCH_PAGES; i++) {
+            sum += *(volatile uint32_t*) (buf + i * PAGE_SIZE + (i % 64) * 64);
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+    asm volatile ("" : : "r" (sum));
+    return cycles;
+}
+
+/**
+ * 任务切换延迟中TLB的部分: 内核映射带有PG_G，开启CR4.PGE时重新加载CR3不会刷掉它们，
+ * 关闭时切换后的每个内核页都要重新查页表. 两种情况下分别测量一次CR3加载加上访问内核页的周期数.
+ */ 
+static void bench_switch_pge(void) {
+    uint8_t* buf = small_pages_alloc(SWITCH_PAGES);
+    if (buf == NULL) {
+        console_put_str("switch: out of memory, skipped\n");
+        return;
+    }
+
+    enum intr_status old_status = intr_disable();
+    uint32_t cr4;
+    asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+
+    switch_walk(buf);
+    uint64_t pge_on = switch_walk(buf);
+
+    // 清除PGE的同时刷新了全部TLB，此后PG_G不再起作用
+    asm volatile ("movl %0, %%cr4" : : "r" (cr4 & ~CR4_PGE) : "memory");
+    switch_walk(buf);
+    uint64_t pge_off = switch_walk(buf);
+    asm volatile ("movl %0, %%cr4" : : "r" (cr4) : "memory");
+
+    intr_set_status(old_status);
+
+    bench_report("cr3 reload + 64 pages, PGE on", pge_on, SWITCH_ROUNDS);
+    bench_report("cr3 reload + 64 pages, PGE off", pge_off, SWITCH_ROUNDS);
+
+    mfree_page(PF_KERNEL, buf, SWITCH_PAGES);
+}
+
+/**
+ * 让出CPU: 当前任务进入expired队列，等本轮其它任务都运行过后再继续.
+ */ 
+static void bench_yield(void) {
+    enum intr_status old_status = intr_disable();
+    schedule();
+    intr_set_status(old_status);
+}
+
+/**
+ * 什么也不做的线程，返回后经kernel_thread调用thread_exit.
+ */ 
+static void bench_exit_func(void* arg UNUSED) {
+    enum intr_status old_status = intr_disable();
+    bench_exited++;
+    intr_set_status(old_status);
+}
+
+/**
+ * 创建一批线程并等待它们全部退出，返回总周期数.
+ */ 
+static uint64_t spawn_batch(void) {
+    bench_exited = 0;
+    uint64_t start = rdtsc();
+
+    uint32_t i;
+    for (i = 0; i < SPAWN_BATCH; i++) {
+        thread_start("bench_spawn", BENCH_PRIO, bench_exit_func, NULL);
+    }
+    while (bench_exited < SPAWN_BATCH) {
+        bench_yield();
+    }
+
+    return rdtsc() - start;
+}
+
+/**
+ * 线程创建加退出的吞吐: 第一批时PCB缓存为空，PCB页都来自内存分配器，退出后缓存被填满，之后的批次全部复用缓存.
+ */ 
+static void bench_spawn_exit(void) {
+    bench_report("spawn+exit, cold pcb cache", spawn_batch(), SPAWN_BATCH);
+
+    uint64_t cycles = 0;
+    uint32_t round;
+    for (round = 0; round < SPAWN_ROUNDS; round++) {
+        cycles += spawn_batch();
+    }
+    bench_report("spawn+exit, warm pcb cache", cycles, SPAWN_ROUNDS * SPAWN_BATCH);
+}
+
+/**
+ * 反复让出CPU，最后退出.
+ */ 
+static void bench_yield_func(void* arg UNUSED) {
+    uint32_t i;
+    for (i = 0; i < YIELD_ROUNDS; i++) {
+        bench_yield();
+    }
+    bench_exit_func(NULL);
+}
+
+/**
+ * 调度开销: 同时有thread_cnt个就绪的线程，每个让出CPU YIELD_ROUNDS次，测量平均每次schedule(含任务切换)的周期数.
+ * 线程在main第一次让出CPU之后才开始运行，创建的开销不计在内.
+ */ 
+static void bench_schedule(char* name, uint32_t thread_cnt) {
+    bench_exited = 0;
+    uint32_t i;
+    for (i = 0; i < thread_cnt; i++) {
+        thread_start("bench_yield", BENCH_PRIO, bench_yield_func, NULL);
+    }
+
+    uint32_t main_yields = 0;
+    uint64_t start = rdtsc();
+    while (bench_exited < thread_cnt) {
+        bench_yield();
+        main_yields++;
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    bench_report(name, cycles, thread_cnt * YIELD_ROUNDS + main_yields);
+}
+
+void bench_run(void) {
+    console_put_str("bench start\n");
+    bench_kmalloc();
+    bench_tlb();
+    bench_v2p();
+    bench_switch_pge();
+    bench_spawn_exit();
+    bench_schedule("schedule, 2 threads", 2);
+    bench_schedule("schedule, 32 threads", 32);
+    bench_schedule("schedule, 128 threads", 128);
+    bench_schedule("schedule, 300 threads", 300);
+    console_put_str("bench done\n");
+}
@@ -0,0 +1,6 @@
+# ifndef _KERNEL_BENCH_H
+# define _KERNEL_BENCH_H
+
+void bench_run(void);
+
+# endif
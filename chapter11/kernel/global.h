@@ -35,6 +35,8 @@
 
 # define NULL 0
 
+# define UNUSED __attribute__ ((unused))
+
 // GDT描述符属性
 # define DESC_G_4K 1
 # define DESC_D_32 1
@@ -6,14 +6,23 @@
 # include "console.h"
 # include "keyboard.h"
 # include "tss.h"
+# include "syscall-init.h"
+# include "ata.h"
+# include "swap.h"
 
 void init_all() {
     put_str("init_all.\n");
     idt_init();
     mem_init();
     thread_init();
+    page_zeroer_init();
     timer_init();
     console_init();
     keyboard_init();
     tss_init();
+    syscall_init();
+    ata_init();
+    swap_init();
+    page_reclaimer_init();
+    ksm_init();
 }
\ No newline at end of file
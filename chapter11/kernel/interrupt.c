@@ -4,7 +4,10 @@
 # include "interrupt.h"
 # include "kernel/print.h"
 
-# define IDT_DESC_CNT 0x30
+# define IDT_DESC_CNT 0x81
+// kernel.asm中由VECTOR宏生成的中断入口个数
+# define INTR_ENTRY_CNT 0x30
+# define SYSCALL_VECTOR 0x80
 # define PIC_M_CTRL 0x20
 # define PIC_M_DATA 0x21
 # define PIC_S_CTRL 0xa0
@@ -30,7 +33,8 @@ static void make_idt_desc(struct gate_desc* p_gdesc, uint8_t attr, intr_handler
 static void init_custom_handler_name();
 static struct gate_desc idt[IDT_DESC_CNT];
 
-extern intr_handler intr_entry_table[IDT_DESC_CNT];
+extern intr_handler intr_entry_table[INTR_ENTRY_CNT];
+extern uint32_t syscall_handler(void);
 
 /**
  * 开中断并返回之前的状态.
@@ -164,9 +168,12 @@ static void make_idt_desc(struct gate_desc* p_gdesc, uint8_t attr, intr_handler
  */ 
 static void idt_desc_init(void) {
     int i;
-    for (i = 0; i < IDT_DESC_CNT; i++) {
+    for (i = 0; i < INTR_ENTRY_CNT; i++) {
         make_idt_desc(&idt[i], IDT_DESC_ATTR_DPL0, intr_entry_table[i]);
     }
+
+    // 系统调用的门描述符DPL为3，用户进程才能通过int 0x80进入
+    make_idt_desc(&idt[SYSCALL_VECTOR], IDT_DESC_ATTR_DPL3, syscall_handler);
     put_str("idt_desc_init done.\n");
 }
 
@@ -33,4 +33,13 @@ static inline void insw(uint16_t port, void* addr, uint32_t word_cnt) {
     asm volatile ("cld; rep insw" : "+D" (addr), "+c" (word_cnt) : "d" (port) : "memory");
 }
 
+/**
+ * 读取时间戳计数器，即CPU上电以来的时钟周期数.
+ */ 
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return (((uint64_t) high << 32) | low);
+}
+
 #endif
\ No newline at end of file
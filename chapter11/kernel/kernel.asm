@@ -4,6 +4,8 @@
 %define ERROR_CODE nop
 ; 如果CPU没有压入错误码，为了保持处理逻辑的一致性，我们需要手动压入一个0
 %define ZERO push 0
+; 系统调用表的项数，与syscall-init.c中的syscall_nr一致
+%define SYSCALL_NR 32
 
 extern put_str
 ; 中断处理函数数组
@@ -33,8 +35,11 @@ intr%1entry:
 
     push %1
 
-    ; 调用C的中断处理函数
+    ; 调用C的中断处理函数，参数依次为中断号和指向中断栈(即上面压入的中断号处)的指针
+    push esp
+    push %1
     call [idt_table + 4 * %1]
+    add esp, 8
     jmp intr_exit
 
 section .data
@@ -62,16 +67,16 @@ VECTOR 0x04, ZERO
 VECTOR 0x05, ZERO
 VECTOR 0x06, ZERO
 VECTOR 0x07, ZERO
-VECTOR 0x08, ZERO
+VECTOR 0x08, ERROR_CODE
 VECTOR 0x09, ZERO
-VECTOR 0x0a, ZERO
-VECTOR 0x0b, ZERO
-VECTOR 0x0c, ZERO
-VECTOR 0x0d, ZERO
-VECTOR 0x0e, ZERO
+VECTOR 0x0a, ERROR_CODE
+VECTOR 0x0b, ERROR_CODE
+VECTOR 0x0c, ERROR_CODE
+VECTOR 0x0d, ERROR_CODE
+VECTOR 0x0e, ERROR_CODE
 VECTOR 0x0f, ZERO
 VECTOR 0x10, ZERO
-VECTOR 0x11, ZERO
+VECTOR 0x11, ERROR_CODE
 VECTOR 0x12, ZERO
 VECTOR 0x13, ZERO
 VECTOR 0x14, ZERO
@@ -101,4 +106,43 @@ VECTOR 0x2b, ZERO
 VECTOR 0x2c, ZERO
 VECTOR 0x2d, ZERO
 VECTOR 0x2e, ZERO
-VECTOR 0x2f, ZERO
\ No newline at end of file
+VECTOR 0x2f, ZERO
+
+; 系统调用中断入口，eax为子功能号，ebx、ecx、edx依次为前三个参数
+[bits 32]
+extern syscall_table
+section .text
+global syscall_handler
+syscall_handler:
+    ; 保持与其它中断一致的中断栈结构
+    push 0
+
+    push ds
+    push es
+    push fs
+    push gs
+    pushad
+
+    push 0x80
+
+    ; 压入系统调用参数
+    push edx
+    push ecx
+    push ebx
+
+    ; 子功能号来自用户进程，越界或未注册时不调用，返回-1
+    cmp eax, SYSCALL_NR
+    jae .bad_syscall
+    mov eax, [syscall_table + eax * 4]
+    test eax, eax
+    jz .bad_syscall
+    call eax
+    jmp .syscall_ret
+.bad_syscall:
+    mov eax, -1
+.syscall_ret:
+    add esp, 12
+
+    ; 将返回值写入中断栈中eax的位置，中断返回后便是用户进程看到的eax
+    mov [esp + 8 * 4], eax
+    jmp intr_exit
\ No newline at end of file
@@ -2,11 +2,21 @@
 # include "init.h"
 # include "interrupt.h"
 # include "process.h"
+# include "thread/thread.h"
+# include "bench.h"
+# include "global.h"
+# include "memory.h"
+# include "timer.h"
+# include "console.h"
+
+// 统计线程打印的间隔毫秒数
+# define STAT_INTERVAL_MS 10000
 
 void k_thread_function_a(void);
 void k_thread_function_b(void);
 void user_process_a(void);
 void user_process_b(void);
+void k_thread_stat(void* arg);
 int test_var_a = 0, test_var_b = 0;
 
 int main(void) {
@@ -14,14 +24,22 @@ int main(void) {
     put_str("I am kernel.\n");
     init_all();
 
+# ifdef BENCH
+    bench_run();
+# endif
+
     thread_start("k_thread_a", default_prio, k_thread_function_a, "threadA ");
     thread_start("k_thread_b", default_prio, k_thread_function_b, "threadB ");
     process_execute(user_process_a, "user_process_a");
     process_execute(user_process_b, "user_process_b");
+    thread_start("k_stat", default_prio, k_thread_stat, NULL);
 
     intr_enable();
 
-    while (1);
+    // main线程没有其它工作，阻塞后CPU交给其它任务，都阻塞时由idle线程停机
+    while (1) {
+        thread_block(TASK_BLOCKED);
+    }
 
     return 0;
 }
@@ -40,6 +58,20 @@ void k_thread_function_b(void) {
     }
 }
 
+/**
+ * 每隔STAT_INTERVAL_MS毫秒打印一次内核的统计信息，持有控制台锁以免与其它线程的输出交错.
+ */ 
+void k_thread_stat(void* arg UNUSED) {
+    while (1) {
+        mtime_sleep(STAT_INTERVAL_MS);
+        console_acquire();
+        print_mem_pool_stat();
+        print_idle_stat();
+        print_tick_stat();
+        console_release();
+    }
+}
+
 void user_process_a(void) {
     while (1) {
         test_var_a++;
@@ -4,111 +4,429 @@
 # include "string.h"
 # include "debug.h"
 # include "thread/sync.h"
+# include "interrupt.h"
+# include "process.h"
+# include "vma.h"
+# include "vmalloc.h"
+# include "swap.h"
+# include "zram.h"
+# include "io.h"
+# include "console.h"
 
 # define PAGE_SIZE 4096
 
-// 位图地址
-# define MEM_BITMAP_BASE 0xc009a000
+// loader保存的地址范围描述符及其个数，见loader.asm
+# define ARDS_BUF_ADDR 0xb0a
+# define ARDS_NR_ADDR 0xbfe
+// ards_buf最多容纳的描述符个数
+# define ARDS_MAX 12
+// 可供操作系统使用的内存
+# define ARDS_TYPE_USABLE 1
 
-// 内核使用的起始虚拟地址
-// 跳过低端1MB内存，中间10为代表页表项偏移，即0x100，即256 * 4KB = 1MB
-# define K_HEAD_START 0xc0100000
+// 页目录的物理地址，见boot.inc
+# define PAGE_DIR_PHY_ADDR 0x100000
+
+// 一个页目录项映射的大小，直接映射区使用4MB大页
+# define LARGE_PAGE_SIZE 0x400000
+// 内核映像所在的第一页，链接时-Ttext指定的入口为0xc0001500
+# define KERNEL_IMAGE_START 0xc0001000
+// vmalloc区最多占用的页目录项个数，只有物理页凑不成连续的块时内核才从这里分配虚拟地址
+# define VMALLOC_PDE_MAX 32
+// 直接映射区最多覆盖的物理内存: 内核空间有255个可用的页目录项(1023号指向页目录自身)，留出vmalloc区后约892MB，更高的内存不使用
+# define DIRECT_MAP_MAX ((255 - VMALLOC_PDE_MAX) << 22)
 
 // 获取高10位页目录项标记
 # define PDE_INDEX(addr) ((addr & 0xffc00000) >> 22)
 // 获取中间10位页表标记 
 # define PTE_INDEX(addr) ((addr & 0x003ff000) >> 12) 
 
+// 一次释放的页数超过此值时，直接重新加载CR3刷新整个TLB，而不是逐页invlpg
+# define TLB_FLUSH_THRESHOLD 32
+
+// 缺页中断错误码: 页存在(即保护违例)、写操作、用户态访问
+# define PF_ERR_P 1
+# define PF_ERR_W 2
+# define PF_ERR_U 4
+
+// pusha一次最多压入32字节，低于esp这个范围内的访问也视为栈的增长
+# define STACK_GROWTH_SLACK 32
+
+// CR0的写保护位
+# define CR0_WP 0x00010000
+// CR4的全局页使能位
+# define CR4_PGE 0x00000080
+
+// 伙伴系统的阶数，最大的块为2^(MAX_ORDER - 1)页，即4MB
+# define MAX_ORDER 11
+
+// 页描述符标志: 此页是某个空闲块的首页
+# define PAGE_BUDDY_FREE 1
+// 页描述符标志: 此页(块)分配给了用户空间，仅对已分配块的首页有效
+# define PAGE_USER 2
+// KSM合并出的只读共享页，挂在稳定表中
+# define PAGE_KSM 4
+// 本轮扫描中内容两轮未变、等待与其它页合并的候选页，挂在不稳定表中
+# define PAGE_KSM_CAND 8
+
+// 已清零页个数低于LOW时唤醒清零线程，清零线程补充到HIGH为止
+# define CLEAN_LOW_WATER 16
+# define CLEAN_HIGH_WATER 64
+// KSM稳定表与不稳定表的哈希桶个数
+# define KSM_HASH_BUCKETS 256
+// 上一轮扫描后新分配的用户页达到此数时唤醒KSM扫描线程
+# define KSM_WAKE_PAGES 256
+
 // static functions declarations
-static void printKernelPoolInfo(struct pool p);
-static void printUserPoolInfo(struct pool p);
+// 链接器提供的内核映像结束地址
+extern char _end[];
+
+static void printMemPoolInfo(struct pool* p);
 static void* vaddr_get(enum pool_flags pf, uint32_t pg_count);
 static uint32_t* pte_ptr(uint32_t vaddr);
 static uint32_t* pde_ptr(uint32_t vaddr);
-static void* palloc(struct pool* m_pool);
-static void page_table_add(void* _vaddr, void* _page_phyaddr);
+static void* palloc(enum pool_flags pf);
+static uint32_t* pte_create(uint32_t vaddr);
+static int page_table_add(void* _vaddr, void* _page_phyaddr);
+static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
+static inline void invlpg(uint32_t vaddr);
+static void tlb_flush_all(void);
+static void tlb_flush_global(void);
+static struct page* buddy_alloc(struct pool* m_pool, uint32_t order);
+static void buddy_free(struct pool* m_pool, struct page* page, uint32_t order);
+static void* palloc_zeroed(enum pool_flags pf);
+static void* palloc_reclaim(enum pool_flags pf, uint8_t zero);
+static void print_ksm_stat(void);
+
+/**
+ * 物理页描述符，每个物理页对应一个.
+ */ 
+struct page {
+    // 空闲链表节点
+    struct list_elem free_tag;
+    // 空闲块的阶数，仅对空闲块的首页有效
+    uint8_t order;
+    uint8_t flags;
+    // 映射此页的页表项个数，写时复制共享的页大于1
+    uint16_t ref_count;
+    // 反向映射: 用户页由哪个任务映射在哪个虚拟地址，换出时据此找到页表项
+    struct task_struct* owner;
+    uint32_t vaddr;
+    // 换入后交换区中仍保留的副本，没有被写过的页换出时不必再写盘，0表示没有
+    uint32_t swap_slot;
+    // 上一轮KSM扫描时页内容的哈希，相邻两轮不变的页才参与合并
+    uint32_t ksm_hash;
+};
+
+/**
+ * 同一阶的空闲块链表.
+ */ 
+struct free_area {
+    struct list free_list;
+    uint32_t nr_free;
+};
 
+/**
+ * 物理内存池，内核与用户共用，哪一方需要页就分给哪一方，通过水位为内核保留一部分页.
+ */ 
 struct pool {
-    struct bitmap pool_bitmap;
     uint32_t phy_addr_start;
     uint32_t pool_size;
     struct lock lock;
+    // 页描述符数组，下标即页在池中的序号
+    struct page* pages;
+    uint32_t page_count;
+    // 伙伴系统的各阶空闲链表
+    struct free_area free_area[MAX_ORDER];
+    uint32_t free_page_count;
+    // 已由清零线程清零的空闲页，不计入free_page_count，节点复用free_tag
+    struct list clean_list;
+    uint32_t clean_count;
+    // 申请清零页时已清零链表命中/未命中(同步清零)的次数
+    uint32_t clean_hits;
+    uint32_t clean_misses;
+    // 水位(页数): 空闲页不高于min时只有内核能继续分配，低于low视为内存紧张，高于high时清零线程才会消耗空闲页
+    uint32_t watermark_min;
+    uint32_t watermark_low;
+    uint32_t watermark_high;
+    // 当前分配给内核/用户的页数
+    uint32_t kernel_pages;
+    uint32_t user_pages;
+    // 压力计数: 分配后空闲页低于low、内核动用了保留页、用户分配因保留页被拒绝的次数
+    uint32_t low_events;
+    uint32_t reserve_allocs;
+    uint32_t user_denied;
+    // 时钟算法的指针，即下一个检查的页
+    uint32_t clock_hand;
+    uint32_t swap_outs;
+    uint32_t swap_ins;
+    // 换入缺页的延迟(时钟周期): 指数滑动平均(权重1/8)和最大值
+    uint32_t swap_in_cycles;
+    uint32_t swap_in_cycles_max;
+    // 上一轮KSM扫描后新分配的用户页数、KSM累计合并的页数
+    uint32_t ksm_new_pages;
+    uint32_t ksm_merges;
+    // 以零页满足的读缺页次数
+    uint32_t zero_page_maps;
 };
 
-struct pool kernel_pool, user_pool;
-struct virtual_addr kernel_addr;
+/**
+ * 地址范围描述符，由loader通过BIOS中断0x15的0xe820子功能获取.
+ */ 
+struct ards {
+    uint32_t base_addr_low;
+    uint32_t base_addr_high;
+    uint32_t length_low;
+    uint32_t length_high;
+    uint32_t type;
+};
 
 /**
- * 初始化内存池.
+ * 一段可用的物理内存，[start, end)均按页对齐.
  */ 
-static void mem_pool_init(uint32_t all_memory) {
-    put_str("Start init Memory pool...\n");
+struct mem_region {
+    uint32_t start;
+    uint32_t end;
+};
 
-    // 页表(一级和二级)占用的内存大小，256的由来:
-    // 一页的页目录，页目录的第0和第768项指向一个页表，此页表分配了低端1MB内存(其实此页表中也只是使用了256个表项)，
-    // 剩余的254个页目录项实际没有分配对应的真实页表，但是需要为内核预留分配的空间
-    uint32_t page_table_size = PAGE_SIZE * 256;
+/**
+ * 内存仓库，kmalloc的内存块从arena中划分，arena元信息位于其所在页的起始处.
+ */ 
+struct arena {
+    struct mem_block_desc* desc;
+    // large为1时表示arena占据的页数，否则表示arena中空闲内存块的个数
+    uint32_t cnt;
+    uint8_t large;
+};
 
-    // 已经使用的内存为: 低端1MB内存 + 现有的页表和页目录占据的空间
-    uint32_t used_mem = (page_table_size + 0x100000);
+struct pool mem_pool;
+// 直接映射区的结束虚拟地址，也是vmalloc区的起始地址
+static uint32_t direct_map_end;
+// 全局共享的零页，只读地映射给所有只被读过的匿名页，不计引用也永不释放
+static uint32_t zero_page_phy;
+// 因无事可做而阻塞的清零线程
+static struct task_struct* zeroer_waiter;
+// 等待内存紧张的回收线程
+static struct task_struct* reclaimer_waiter;
+// 换出、换入以及释放换出的页表项互斥，换出写盘期间访问此页的任务在换入时等待
+static struct lock swap_lock;
+// 等待新用户页的KSM扫描线程
+static struct task_struct* ksm_waiter;
+// KSM稳定表和不稳定表，按页内容的哈希分桶，节点复用页描述符的free_tag
+static struct list ksm_stable[KSM_HASH_BUCKETS];
+static struct list ksm_unstable[KSM_HASH_BUCKETS];
+// 内核内存块描述符
+struct mem_block_desc k_block_descs[DESC_CNT];
 
-    uint32_t free_mem = (all_memory - used_mem);
-    uint16_t free_pages = free_mem / PAGE_SIZE;
+/**
+ * 初始化池的伙伴系统，此时池中的页都不可用，之后由buddy_free_range加入可用的页.
+ */ 
+static void buddy_init(struct pool* m_pool) {
+    uint32_t order;
+    for (order = 0; order < MAX_ORDER; order++) {
+        list_init(&m_pool->free_area[order].free_list);
+        m_pool->free_area[order].nr_free = 0;
+    }
+    m_pool->free_page_count = 0;
 
-    uint16_t kernel_free_pages = (free_pages >> 1);
-    uint16_t user_free_pages = (free_pages - kernel_free_pages);
+    list_init(&m_pool->clean_list);
+    m_pool->clean_count = m_pool->clean_hits = m_pool->clean_misses = 0;
 
-    // 内核空间bitmap长度(字节)，每一位代表一页
-    uint32_t kernel_bitmap_length = kernel_free_pages / 8;
-    uint32_t user_bitmap_length = user_free_pages / 8;
+    memset(m_pool->pages, 0, m_pool->page_count * sizeof(struct page));
+}
 
-    // 内核内存池起始物理地址，注意内核的虚拟地址占据地址空间的顶端，但是实际映射的物理地址是在这里
-    uint32_t kernel_pool_start = used_mem;
-    uint32_t user_pool_start = (kernel_pool_start + kernel_free_pages * PAGE_SIZE);
+/**
+ * 把池中第start到end - 1页按能对齐的最大块挂到各阶空闲链表上，范围之外的页(空洞)永远不会被分配或合并.
+ */ 
+static void buddy_free_range(struct pool* m_pool, uint32_t start, uint32_t end) {
+    uint32_t page_idx = start, order;
+    while (page_idx < end) {
+        order = MAX_ORDER - 1;
+        while ((page_idx & ((1 << order) - 1)) || page_idx + (1 << order) > end) {
+            --order;
+        }
 
-    kernel_pool.phy_addr_start = kernel_pool_start;
-    user_pool.phy_addr_start = user_pool_start;
+        buddy_free(m_pool, &m_pool->pages[page_idx], order);
+        page_idx += (1 << order);
+    }
+}
 
-    kernel_pool.pool_size = kernel_free_pages * PAGE_SIZE;
-    user_pool.pool_size = user_free_pages * PAGE_SIZE;
+/**
+ * 从loader保存的e820内存布局中取出[start_limit, end_limit)内的可用内存，按起始地址升序保存在regions中，返回个数.
+ */ 
+static uint32_t mem_regions_get(struct mem_region* regions, uint32_t start_limit, uint32_t end_limit) {
+    struct ards* ards = (struct ards*) ARDS_BUF_ADDR;
+    uint32_t ards_nr = *(uint16_t*) ARDS_NR_ADDR, nr = 0, i;
+    if (ards_nr > ARDS_MAX) {
+        ards_nr = ARDS_MAX;
+    }
 
-    kernel_pool.pool_bitmap.btmp_bytes_len = kernel_bitmap_length;
-    user_pool.pool_bitmap.btmp_bytes_len = user_bitmap_length;
+    for (i = 0; i < ards_nr; i++) {
+        if (ards[i].type != ARDS_TYPE_USABLE || ards[i].base_addr_high != 0) {
+            continue;
+        }
 
-    // 内核bitmap和user bitmap bit数组的起始地址
-    kernel_pool.pool_bitmap.bits = (void*) MEM_BITMAP_BASE;
-    user_pool.pool_bitmap.bits = (void*) (MEM_BITMAP_BASE + kernel_bitmap_length);
+        uint32_t start = ards[i].base_addr_low, end = start + ards[i].length_low;
+        if (ards[i].length_high != 0 || end < start) {
+            // 越过4GB的部分无法访问
+            end = 0xfffff000;
+        }
+        start = DIV_ROUND_UP(start, PAGE_SIZE) * PAGE_SIZE;
+        end &= 0xfffff000;
+        if (start < start_limit) {
+            start = start_limit;
+        }
+        if (end > end_limit) {
+            end = end_limit;
+        }
+        if (start >= end) {
+            continue;
+        }
 
-    printKernelPoolInfo(kernel_pool);
-    printUserPoolInfo(user_pool);
+        // 插入排序，BIOS并不保证描述符有序
+        uint32_t pos = nr;
+        while (pos > 0 && regions[pos - 1].start > start) {
+            regions[pos] = regions[pos - 1];
+            --pos;
+        }
+        regions[pos].start = start;
+        regions[pos].end = end;
+        ++nr;
+    }
 
-    bitmap_init(&kernel_pool.pool_bitmap);
-    bitmap_init(&user_pool.pool_bitmap);
+    return nr;
+}
 
-    kernel_addr.vaddr_bitmap.btmp_bytes_len = kernel_bitmap_length;
-    // 内核虚拟地址池仍然保存在低端内存以内
-    kernel_addr.vaddr_bitmap.bits = (void*) (MEM_BITMAP_BASE + kernel_bitmap_length + user_bitmap_length);
-    kernel_addr.vaddr_start = K_HEAD_START;
+/**
+ * 根据池中的空闲页数设置水位: min约为1/128，在32到1024页之间，low和high分别再高出min的1/4和1/2.
+ */ 
+static void watermark_init(struct pool* m_pool) {
+    uint32_t min = m_pool->free_page_count / 128;
+    if (min < 32) {
+        min = 32;
+    } else if (min > 1024) {
+        min = 1024;
+    }
 
-    bitmap_init(&kernel_addr.vaddr_bitmap);
-    put_str("Init memory pool done.\n");
+    m_pool->watermark_min = min;
+    m_pool->watermark_low = min + (min >> 2);
+    m_pool->watermark_high = min + (min >> 1);
+    m_pool->kernel_pages = m_pool->user_pages = 0;
+    m_pool->low_events = m_pool->reserve_allocs = m_pool->user_denied = 0;
+    m_pool->clock_hand = m_pool->swap_outs = m_pool->swap_ins = 0;
+    m_pool->swap_in_cycles = m_pool->swap_in_cycles_max = 0;
 }
 
-static void printKernelPoolInfo(struct pool p) {
-    put_str("Kernel pool bitmap address: ");
-    put_int(p.pool_bitmap.bits);
-    put_str("; Kernel pool physical address: ");
-    put_int(p.phy_addr_start);
-    put_str("; Kernel pool length: ");
-    put_int(p.pool_bitmap.btmp_bytes_len);
-    put_char('\n');
+/**
+ * 初始化内存池. 所有可用内存(包括空洞)共用一个按物理页号索引的页描述符数组，
+ * 内核和用户从同一个池中分配，池中的空洞不会进入伙伴系统. 池中的物理内存全部线性映射到直接映射区.
+ */ 
+static void mem_pool_init(void) {
+    put_str("Start init Memory pool...\n");
+
+    // 已经使用的内存为: 低端1MB内存 + 页目录
+    uint32_t used_mem = PAGE_DIR_PHY_ADDR + PAGE_SIZE;
+
+    struct mem_region regions[ARDS_MAX];
+    uint32_t region_nr = mem_regions_get(regions, used_mem, DIRECT_MAP_MAX), i;
+    // 元数据从页目录之后开始连续存放，页目录之后必须是可用内存
+    if (region_nr == 0 || regions[0].start != used_mem) {
+        PANIC("mem_pool_init: no usable memory above 1MB!");
+    }
+
+    uint32_t usable_pages = 0;
+    for (i = 0; i < region_nr; i++) {
+        usable_pages += (regions[i].end - regions[i].start) / PAGE_SIZE;
+        put_str("Usable memory: ");
+        put_int(regions[i].start);
+        put_str(" - ");
+        put_int(regions[i].end);
+        put_char('\n');
+    }
+
+    // 页描述符数组覆盖从0到最高可用地址的所有物理页
+    uint32_t all_pages = regions[region_nr - 1].end / PAGE_SIZE;
+    uint32_t mem_map_pages = DIV_ROUND_UP(all_pages * sizeof(struct page), PAGE_SIZE);
+
+    // 用4MB大页把0到最高可用地址的物理内存映射到直接映射区，低端4MB已由loader映射. 内核空间的页目录项
+    // 在这里一次建好，之后创建的进程复制内核的页目录项即可共享. 直接映射区只允许特权级0访问
+    direct_map_end = K_VADDR_START + DIV_ROUND_UP(regions[region_nr - 1].end, LARGE_PAGE_SIZE) * LARGE_PAGE_SIZE;
+    uint32_t vaddr;
+    for (vaddr = K_VADDR_START + LARGE_PAGE_SIZE; vaddr < direct_map_end; vaddr += LARGE_PAGE_SIZE) {
+        *pde_ptr(vaddr) = ((vaddr - K_VADDR_START) | PG_PS | PG_G | PG_RW_W | PG_P_1);
+    }
+
+    // vmalloc区紧接直接映射区，其页表同样预先建好，大小足以在物理内存完全碎片化时容纳所有的可用页
+    uint32_t vmalloc_pt_pages = DIV_ROUND_UP(usable_pages, 1024);
+    if (vmalloc_pt_pages > VMALLOC_PDE_MAX) {
+        vmalloc_pt_pages = VMALLOC_PDE_MAX;
+    }
+
+    // 内存布局: 页目录 | 低端4MB页表 | vmalloc区页表 | 页描述符数组 | 空闲页
+    uint32_t low_pt_phyaddr = used_mem;
+    uint32_t vmalloc_pt_start = low_pt_phyaddr + PAGE_SIZE;
+    uint32_t mem_map_phyaddr = vmalloc_pt_start + vmalloc_pt_pages * PAGE_SIZE;
+    uint32_t meta_end = mem_map_phyaddr + mem_map_pages * PAGE_SIZE;
+    if (meta_end > regions[0].end) {
+        PANIC("mem_pool_init: memory metadata does not fit!");
+    }
+    regions[0].start = meta_end;
+    usable_pages -= (meta_end - used_mem) / PAGE_SIZE;
+
+    // loader用一个允许用户访问的4MB大页映射低端4MB，页目录、页表和页描述符数组都在其中. 改用4KB的页表映射，
+    // 只有内核映像(演示用的用户进程直接运行内核代码、读写内核的全局变量)允许特权级3访问
+    uint32_t* low_pt = phy2virt(low_pt_phyaddr);
+    uint32_t user_start = KERNEL_IMAGE_START, user_end = DIV_ROUND_UP((uint32_t) _end, PAGE_SIZE) * PAGE_SIZE;
+    for (i = 0; i < 1024; i++) {
+        vaddr = K_VADDR_START + i * PAGE_SIZE;
+        low_pt[i] = ((i * PAGE_SIZE) | PG_G | PG_RW_W | PG_P_1);
+        if (vaddr >= user_start && vaddr < user_end) {
+            low_pt[i] |= PG_US_U;
+        }
+    }
+    *pde_ptr(K_VADDR_START) = (low_pt_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+    // 大页表项是全局的，重新加载CR3不会将其清除
+    tlb_flush_global();
+
+    // 安装vmalloc区的页表，页表已在直接映射区中，可以直接清零. 同样只允许特权级0访问
+    uint32_t count = 0;
+    while (count < vmalloc_pt_pages) {
+        uint32_t pt_phyaddr = vmalloc_pt_start + count * PAGE_SIZE;
+        memset(phy2virt(pt_phyaddr), 0, PAGE_SIZE);
+        *pde_ptr(direct_map_end + (count << 22)) = (pt_phyaddr | PG_US_S | PG_RW_W | PG_P_1);
+        ++count;
+    }
+    kvaddr_init(direct_map_end, vmalloc_pt_pages * 1024);
+
+    struct page* mem_map = phy2virt(mem_map_phyaddr);
+
+    mem_pool.phy_addr_start = regions[0].start;
+    mem_pool.pool_size = regions[region_nr - 1].end - mem_pool.phy_addr_start;
+    mem_pool.pages = &mem_map[mem_pool.phy_addr_start / PAGE_SIZE];
+    mem_pool.page_count = mem_pool.pool_size / PAGE_SIZE;
+
+    buddy_init(&mem_pool);
+    for (i = 0; i < region_nr; i++) {
+        buddy_free_range(&mem_pool, (regions[i].start - mem_pool.phy_addr_start) / PAGE_SIZE,
+                         (regions[i].end - mem_pool.phy_addr_start) / PAGE_SIZE);
+    }
+    watermark_init(&mem_pool);
+
+    printMemPoolInfo(&mem_pool);
+
+    put_str("Init memory pool done.\n");
 }
 
-static void printUserPoolInfo(struct pool p) {
-    put_str("User pool bitmap address: ");
-    put_int(p.pool_bitmap.bits);
-    put_str("; User pool physical address: ");
-    put_int(p.phy_addr_start);
+static void printMemPoolInfo(struct pool* p) {
+    put_str("Memory pool page desc address: ");
+    put_int((uint32_t) p->pages);
+    put_str("; Memory pool physical address: ");
+    put_int(p->phy_addr_start);
+    put_str("; Memory pool free pages: ");
+    put_int(p->free_page_count);
+    put_str("; watermark min: ");
+    put_int(p->watermark_min);
+    put_str("; direct map end: ");
+    put_int(direct_map_end);
     put_char('\n');
 }
 
@@ -116,36 +434,18 @@ static void printUserPoolInfo(struct pool p) {
  * 申请指定个数的虚拟页.返回虚拟页的起始地址，失败返回NULL.
  */ 
 static void* vaddr_get(enum pool_flags pf, uint32_t pg_count) {
-    int vaddr_start = 0, bit_idx_start = -1;
-    uint32_t count = 0;
+    uint32_t vaddr_start = 0;
 
     if (pf == PF_KERNEL) {
-        bit_idx_start = bitmap_scan(&kernel_addr.vaddr_bitmap, pg_count);
-        if (bit_idx_start == -1) {
-            // 申请失败，虚拟内存不足
-            return NULL;
-        }
-
-        // 修改bitmap，占用虚拟内存
-        while (count < pg_count) {
-            bitmap_set(&kernel_addr.vaddr_bitmap, (bit_idx_start + count), 1);
-            ++count;
-        }
-
-        vaddr_start = (kernel_addr.vaddr_start + bit_idx_start * PAGE_SIZE); 
+        // 失败时为0，即虚拟内存不足
+        vaddr_start = kvaddr_alloc(pg_count);
     } else {
-        struct task_struct* cur = running_thread();
-        bit_idx_start = bitmap_scan(&cur->userprog_addr.vaddr_bitmap, pg_count);
+        struct vm_space* vs = &running_thread()->vm_space;
+        vaddr_start = vma_get_unmapped(vs, pg_count * PAGE_SIZE);
 
-        if (bit_idx_start == -1) {
+        if (vaddr_start == 0 || vma_map(vs, vaddr_start, vaddr_start + pg_count * PAGE_SIZE, VM_WRITE) == -1) {
             return NULL;
         }
-
-        while (count < pg_count) {
-            bitmap_set(&cur->userprog_addr.vaddr_bitmap, bit_idx_start + count++, 1);
-        }
-
-        vaddr_start = cur->userprog_addr.vaddr_start + bit_idx_start * PAGE_SIZE;
     }
 
     return (void*) vaddr_start;
@@ -165,48 +465,343 @@ static uint32_t* pde_ptr(uint32_t vaddr) {
     return (uint32_t*) ((0xfffff000) + (PDE_INDEX(vaddr) << 2));
 }
 
+static uint32_t page_to_phy(struct pool* m_pool, struct page* page) {
+    return m_pool->phy_addr_start + (page - m_pool->pages) * PAGE_SIZE;
+}
+
+/**
+ * 物理地址对应的页描述符.
+ */ 
+static struct page* phy_to_page(uint32_t pg_phy_addr) {
+    ASSERT(pg_phy_addr >= mem_pool.phy_addr_start && pg_phy_addr - mem_pool.phy_addr_start < mem_pool.pool_size);
+    return &mem_pool.pages[(pg_phy_addr - mem_pool.phy_addr_start) / PAGE_SIZE];
+}
+
 /**
- * 在给定的物理内存池中分配一个物理页，返回其物理地址.
+ * 从伙伴系统中分配2^order个连续的物理页，返回首页的描述符，失败返回NULL.
  */ 
-static void* palloc(struct pool* m_pool) {
-    int bit_index = bitmap_scan(&m_pool->pool_bitmap, 1);
-    if (bit_index == -1) {
+static struct page* buddy_alloc(struct pool* m_pool, uint32_t order) {
+    enum intr_status old_status = intr_disable();
+
+    // 找到第一个有空闲块的阶
+    uint32_t current_order = order;
+    while (current_order < MAX_ORDER && list_empty(&m_pool->free_area[current_order].free_list)) {
+        ++current_order;
+    }
+
+    if (current_order == MAX_ORDER) {
+        intr_set_status(old_status);
         return NULL;
     }
 
-    bitmap_set(&m_pool->pool_bitmap, bit_index, 1);
-    uint32_t page_phyaddr = ((bit_index * PAGE_SIZE) + m_pool->phy_addr_start);
-    return (void*) page_phyaddr;
+    struct page* page = elem2entry(struct page, free_tag, list_pop(&m_pool->free_area[current_order].free_list));
+    m_pool->free_area[current_order].nr_free--;
+    page->flags &= ~PAGE_BUDDY_FREE;
+
+    // 大块逐级对半拆分，后一半挂回低一阶的空闲链表
+    while (current_order > order) {
+        --current_order;
+        struct page* buddy = page + (1 << current_order);
+        buddy->order = current_order;
+        buddy->flags |= PAGE_BUDDY_FREE;
+        list_push(&m_pool->free_area[current_order].free_list, &buddy->free_tag);
+        m_pool->free_area[current_order].nr_free++;
+    }
+
+    page->order = order;
+    page->ref_count = 1;
+    m_pool->free_page_count -= (1 << order);
+
+    intr_set_status(old_status);
+    return page;
 }
 
 /**
- * 通过页表建立虚拟页与物理页的映射关系.
+ * 将2^order个页归还伙伴系统，伙伴同样空闲时逐级合并.
  */ 
-static void page_table_add(void* _vaddr, void* _page_phyaddr) {
-    uint32_t vaddr = (uint32_t) _vaddr, page_phyaddr = (uint32_t) _page_phyaddr;
-    uint32_t* pde = pde_ptr(vaddr); uint32_t* pte = pte_ptr(vaddr);
+static void buddy_free(struct pool* m_pool, struct page* page, uint32_t order) {
+    enum intr_status old_status = intr_disable();
 
-    if (*pde & 0x00000001) {
-        // 页目录项已经存在
-        if (!(*pte & 0x00000001)) {
-            // 物理页必定不存在，使页表项指向我们新分配的物理页
-            *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+    uint32_t page_idx = page - m_pool->pages;
+    ASSERT(page_idx < m_pool->page_count && !(page_idx & ((1 << order) - 1)));
+
+    m_pool->free_page_count += (1 << order);
+
+    while (order < MAX_ORDER - 1) {
+        uint32_t buddy_idx = page_idx ^ (1 << order);
+        if (buddy_idx + (1 << order) > m_pool->page_count) {
+            break;
+        }
+
+        struct page* buddy = &m_pool->pages[buddy_idx];
+        if (!(buddy->flags & PAGE_BUDDY_FREE) || buddy->order != order) {
+            break;
+        }
+
+        // 伙伴空闲，摘下后合并成高一阶的块
+        list_remove(&buddy->free_tag);
+        m_pool->free_area[order].nr_free--;
+        buddy->flags &= ~PAGE_BUDDY_FREE;
+
+        page_idx &= buddy_idx;
+        ++order;
+    }
+
+    page = &m_pool->pages[page_idx];
+    page->order = order;
+    page->flags |= PAGE_BUDDY_FREE;
+    list_push(&m_pool->free_area[order].free_list, &page->free_tag);
+    m_pool->free_area[order].nr_free++;
+
+    intr_set_status(old_status);
+}
+
+/**
+ * 检查pf一方能否再分配pg_cnt个页: 空闲页(含已清零的页)将低于min时拒绝用户以及带PF_NORESERVE的内核分配，
+ * 保留给内核. 需要关中断调用.
+ */ 
+static int watermark_ok(struct pool* m_pool, enum pool_flags pf, uint32_t pg_cnt) {
+    if (((pf & PF_KERNEL) && !(pf & PF_NORESERVE))
+        || m_pool->free_page_count + m_pool->clean_count >= m_pool->watermark_min + pg_cnt) {
+        return 1;
+    }
+
+    if (pf & PF_USER) {
+        m_pool->user_denied++;
+    }
+    return 0;
+}
+
+/**
+ * 记录2^order个页归pf一方所有，并统计内存压力. 需要关中断调用.
+ */ 
+static void page_account(struct pool* m_pool, struct page* page, enum pool_flags pf, uint32_t order) {
+    uint32_t free_pages = m_pool->free_page_count + m_pool->clean_count;
+
+    if (pf & PF_KERNEL) {
+        page->flags &= ~PAGE_USER;
+        m_pool->kernel_pages += (1 << order);
+        if (free_pages < m_pool->watermark_min) {
+            m_pool->reserve_allocs++;
+        }
+    } else {
+        page->flags |= PAGE_USER;
+        m_pool->user_pages += (1 << order);
+        m_pool->ksm_new_pages += (1 << order);
+        if (m_pool->ksm_new_pages >= KSM_WAKE_PAGES && ksm_waiter != NULL) {
+            thread_unblock(ksm_waiter);
+            ksm_waiter = NULL;
+        }
+    }
+
+    if (free_pages < m_pool->watermark_low) {
+        m_pool->low_events++;
+        // 内存紧张，让回收线程开始换出
+        if (reclaimer_waiter != NULL) {
+            thread_unblock(reclaimer_waiter);
+            reclaimer_waiter = NULL;
+        }
+    }
+}
+
+/**
+ * 为pf一方分配2^order个连续的物理页，返回首页的描述符，失败返回NULL.
+ */ 
+static struct page* pool_alloc(enum pool_flags pf, uint32_t order) {
+    enum intr_status old_status = intr_disable();
+    struct page* page = NULL;
+
+    if (watermark_ok(&mem_pool, pf, 1 << order)) {
+        page = buddy_alloc(&mem_pool, order);
+        if (page == NULL && order == 0 && !list_empty(&mem_pool.clean_list)) {
+            // 伙伴系统已空，已清零的页同样可用
+            page = elem2entry(struct page, free_tag, list_pop(&mem_pool.clean_list));
+            mem_pool.clean_count--;
+        }
+
+        if (page != NULL) {
+            page_account(&mem_pool, page, pf, order);
+        }
+    }
+
+    intr_set_status(old_status);
+    return page;
+}
+
+/**
+ * 为pf一方分配一个物理页，返回其物理地址.
+ */ 
+static void* palloc(enum pool_flags pf) {
+    struct page* page = pool_alloc(pf, 0);
+    if (page == NULL) {
+        return NULL;
+    }
+
+    return (void*) page_to_phy(&mem_pool, page);
+}
+
+/**
+ * 为pf一方分配2^order个物理地址连续的页(如供DMA使用)，返回其起始物理地址，失败返回NULL.
+ */ 
+void* alloc_phy_pages(enum pool_flags pf, uint32_t order) {
+    ASSERT(order < MAX_ORDER);
+
+    struct page* page = pool_alloc(pf, order);
+    if (page == NULL) {
+        return NULL;
+    }
+
+    return (void*) page_to_phy(&mem_pool, page);
+}
+
+/**
+ * 归还由alloc_phy_pages分配的2^order个物理页.
+ */ 
+void free_phy_pages(uint32_t pg_phy_addr, uint32_t order) {
+    ASSERT(order < MAX_ORDER);
+
+    enum intr_status old_status = intr_disable();
+
+    struct page* page = phy_to_page(pg_phy_addr);
+    if (page->flags & PAGE_USER) {
+        if (page->flags & (PAGE_KSM | PAGE_KSM_CAND)) {
+            list_remove(&page->free_tag);
+        }
+        page->flags &= ~(PAGE_USER | PAGE_KSM | PAGE_KSM_CAND);
+        page->owner = NULL;
+        page->ksm_hash = 0;
+        if (page->swap_slot != 0) {
+            swap_slot_put(page->swap_slot);
+            page->swap_slot = 0;
         }
+        mem_pool.user_pages -= (1 << order);
     } else {
-        // 新分配一个物理页作为页表
-        uint32_t pde_phyaddr = (uint32_t) palloc(&kernel_pool);
+        mem_pool.kernel_pages -= (1 << order);
+    }
+    buddy_free(&mem_pool, page, order);
+
+    intr_set_status(old_status);
+}
+
+/**
+ * 得到虚拟地址对应的PTE指针，页目录项不存在时新分配一个物理页作为页表，分配失败返回NULL.
+ */ 
+static uint32_t* pte_create(uint32_t vaddr) {
+    uint32_t* pde = pde_ptr(vaddr); uint32_t* pte = pte_ptr(vaddr);
+
+    if (!(*pde & 0x00000001)) {
+        uint32_t pde_phyaddr = (uint32_t) palloc(PF_KERNEL);
+        if (pde_phyaddr == 0) {
+            return NULL;
+        }
         *pde = (pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
         // 清理物理页
         memset((void*) ((int) pte & 0xfffff000), 0, PAGE_SIZE);
-        *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
     }
+
+    return pte;
 }
 
 /**
- * 分配page_count个页空间，自动建立虚拟页与物理页的映射.
+ * 记录用户页由当前任务映射在vaddr处.
  */ 
-void* malloc_page(enum pool_flags pf, uint32_t page_count) {
-    ASSERT(page_count > 0 && page_count < 3840);
+static void page_rmap_set(struct page* page, uint32_t vaddr) {
+    page->owner = running_thread();
+    page->vaddr = (vaddr & 0xfffff000);
+}
+
+/**
+ * 通过页表建立虚拟页与物理页的映射关系，分配不出页表时返回-1，由调用者归还物理页.
+ */ 
+static int page_table_add(void* _vaddr, void* _page_phyaddr) {
+    uint32_t page_phyaddr = (uint32_t) _page_phyaddr;
+    uint32_t* pte = pte_create((uint32_t) _vaddr);
+    if (pte == NULL) {
+        return -1;
+    }
+
+    // 只映射着零页的地址同样可以换成新分配的物理页
+    if (!(*pte & 0x00000001) || (*pte & 0xfffff000) == zero_page_phy) {
+        if (*pte & 0x00000001) {
+            invlpg((uint32_t) _vaddr);
+        }
+        // 使页表项指向我们新分配的物理页，内核页是全局的且只允许特权级0访问
+        if ((uint32_t) _vaddr >= K_VADDR_START) {
+            *pte = (page_phyaddr | PG_G | PG_US_S | PG_RW_W | PG_P_1);
+        } else {
+            *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+            page_rmap_set(phy_to_page(page_phyaddr), (uint32_t) _vaddr);
+        }
+    }
+    return 0;
+}
+
+/**
+ * 为内核分配pg_cnt个物理连续的页，返回其在直接映射区的虚拟地址，不需要修改页表. 按2的幂分配的块多出的尾部立即归还伙伴系统.
+ */ 
+static void* kernel_pages_alloc(uint32_t pg_cnt, uint8_t zero) {
+    if (pg_cnt == 1) {
+        uint32_t pg_phy_addr = (uint32_t) palloc_reclaim(PF_KERNEL, zero);
+        return (pg_phy_addr == 0 ? NULL : phy2virt(pg_phy_addr));
+    }
+
+    uint32_t order = 0;
+    while ((1u << order) < pg_cnt) {
+        ++order;
+    }
+    if (order >= MAX_ORDER) {
+        return NULL;
+    }
+
+    enum intr_status old_status = intr_disable();
+
+    struct page* page = pool_alloc(PF_KERNEL, order);
+    if (page == NULL) {
+        intr_set_status(old_status);
+        return NULL;
+    }
+
+    // 释放时逐页归还，每页都要有自己的引用计数
+    uint32_t idx;
+    for (idx = 1; idx < pg_cnt; idx++) {
+        page[idx].ref_count = 1;
+    }
+
+    // 尾部按能对齐的最大块归还，块的大小即下标最低的1位
+    idx = pg_cnt;
+    while (idx < (1u << order)) {
+        uint32_t tail_order = 0;
+        while (!(idx & (1 << tail_order))) {
+            ++tail_order;
+        }
+
+        buddy_free(&mem_pool, &page[idx], tail_order);
+        idx += (1 << tail_order);
+    }
+    mem_pool.kernel_pages -= ((1 << order) - pg_cnt);
+
+    intr_set_status(old_status);
+
+    void* vaddr = phy2virt(page_to_phy(&mem_pool, page));
+    if (zero) {
+        memset(vaddr, 0, pg_cnt * PAGE_SIZE);
+    }
+    return vaddr;
+}
+
+/**
+ * 分配page_count个页空间并建立映射，zero不为0时物理页的内容保证为0. 内核优先使用直接映射区，
+ * 凑不出足够大的连续物理块时才在vmalloc区逐页建立映射.
+ */ 
+static void* page_alloc_map(enum pool_flags pf, uint32_t page_count, uint8_t zero) {
+    ASSERT(page_count > 0);
+
+    if (pf == PF_KERNEL) {
+        void* vaddr = kernel_pages_alloc(page_count, zero);
+        if (vaddr != NULL) {
+            return vaddr;
+        }
+    }
 
     // 在虚拟地址池中申请虚拟内存
     void* vaddr_start = vaddr_get(pf, page_count);
@@ -215,16 +810,25 @@ void* malloc_page(enum pool_flags pf, uint32_t page_count) {
     }
 
     uint32_t vaddr = (uint32_t) vaddr_start, count = page_count;
-    struct pool* mem_pool = (pf & PF_KERNEL) ? &kernel_pool : &user_pool;
 
     // 物理页不必连续，逐个与虚拟页做映射
     while (count > 0) {
-        void* page_phyaddr = palloc(mem_pool);
+        void* page_phyaddr = palloc_reclaim(pf, zero);
+        if (page_phyaddr != NULL && page_table_add((void*) vaddr, page_phyaddr) == -1) {
+            // 页表都分配不出来，此页无处映射
+            pfree((uint32_t) page_phyaddr);
+            page_phyaddr = NULL;
+        }
+
         if (page_phyaddr == NULL) {
+            // 回滚: 已映射的页连同其虚拟地址一并释放，再归还其余尚未映射的虚拟地址
+            if (vaddr > (uint32_t) vaddr_start) {
+                mfree_page(pf, vaddr_start, (vaddr - (uint32_t) vaddr_start) / PAGE_SIZE);
+            }
+            vaddr_remove(pf, (void*) vaddr, count);
             return NULL;
         }
 
-        page_table_add((void*) vaddr, page_phyaddr);
         vaddr += PAGE_SIZE;
         --count;
     }
@@ -233,28 +837,29 @@ void* malloc_page(enum pool_flags pf, uint32_t page_count) {
 }
 
 /**
- * 在内核内存池中申请page_count个页.
+ * 分配page_count个页空间，自动建立虚拟页与物理页的映射.
+ */ 
+void* malloc_page(enum pool_flags pf, uint32_t page_count) {
+    return page_alloc_map(pf, page_count, 0);
+}
+
+/**
+ * 在内核内存池中申请page_count个页，页的内容已清零.
  */ 
 void* get_kernel_pages(uint32_t page_count) {
-    void* vaddr = malloc_page(PF_KERNEL, page_count);
-    if (vaddr != NULL) {
-        memset(vaddr, 0, page_count * PAGE_SIZE);
-    }
-    return vaddr;
+    return page_alloc_map(PF_KERNEL, page_count, 1);
 }
 
 /**
- * 在用户空间中申请page_count页内存，并返回其虚拟地址.
+ * 在用户空间中申请page_count页内存，并返回其虚拟地址. 这里只占用虚拟地址，物理页在第一次访问时由缺页中断分配并清零.
  */ 
 void* get_user_pages(uint32_t page_count) {
     // 可能有多个线程/进程同时申请
-    lock_acquire(&user_pool.lock);
+    lock_acquire(&mem_pool.lock);
 
-    void* vaddr = malloc_page(PF_USER, page_count);
+    void* vaddr = vaddr_get(PF_USER, page_count);
 
-    memset(vaddr, 0, page_count * PAGE_SIZE);
-
-    lock_release(&user_pool.lock);
+    lock_release(&mem_pool.lock);
     return vaddr;    
 }
 
@@ -262,49 +867,1154 @@ void* get_user_pages(uint32_t page_count) {
  * 将地址vaddr与pf池中的物理地址关联，仅支持一页内存分配.
  */ 
 void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
-    struct pool* mem_pool = (pf & PF_KERNEL) ? &kernel_pool : &user_pool;
-
-    lock_acquire(&mem_pool->lock);
+    lock_acquire(&mem_pool.lock);
 
     struct task_struct* cur = running_thread();
-    int32_t bit_idx = -1;
 
     if (cur->pgdir != NULL && pf == PF_USER) {
-        // 用户进程内存，修改进程对应的虚拟地址位图
-        bit_idx = (vaddr - cur->userprog_addr.vaddr_start) / PAGE_SIZE;
-        bitmap_set(&cur->userprog_addr.vaddr_bitmap, bit_idx, 1);
+        // 用户进程内存，把此页加入进程的虚拟内存区域
+        if (vma_find(&cur->vm_space, vaddr) == NULL && vma_map(&cur->vm_space, vaddr, vaddr + PAGE_SIZE, VM_WRITE) == -1) {
+            lock_release(&mem_pool.lock);
+            return NULL;
+        }
     } else if (cur->pgdir == NULL && pf == PF_KERNEL) {
-        // 内核线程
-        bit_idx = (vaddr - kernel_addr.vaddr_start) / PAGE_SIZE;
-        bitmap_set(&kernel_addr.vaddr_bitmap, bit_idx, 1);
+        // 内核线程，此页必须尚未被占用
+        if (kvaddr_reserve(vaddr, 1) == -1) {
+            lock_release(&mem_pool.lock);
+            return NULL;
+        }
     } else {
         PANIC("Unknown memory space type.\n");
     }
 
-    void* page_phyaddr = palloc(mem_pool);
+    void* page_phyaddr = palloc_reclaim(pf, 0);
+    if (page_phyaddr != NULL && page_table_add((void*) vaddr, page_phyaddr) == -1) {
+        pfree((uint32_t) page_phyaddr);
+        page_phyaddr = NULL;
+    }
+
     if (page_phyaddr == NULL) {
+        // 归还内核线程保留的地址，用户进程的区域留给之后的缺页按需分配
+        if (pf == PF_KERNEL) {
+            kvaddr_free(vaddr, 1);
+        }
+        lock_release(&mem_pool.lock);
         return NULL;
     }
 
-    page_table_add((void*) vaddr, page_phyaddr);
-
-    lock_release(&mem_pool->lock);
+    lock_release(&mem_pool.lock);
     return (void*) vaddr;
 }
 
 /**
- * 将给定的虚拟地址转为物理地址.
+ * 将给定的虚拟地址转为物理地址，直接映射区内只需一次减法.
  */ 
 uint32_t addr_v2p(uint32_t vaddr) {
+    if (vaddr >= K_VADDR_START && vaddr < direct_map_end) {
+        return vaddr - K_VADDR_START;
+    }
+
+    uint32_t pde = *pde_ptr(vaddr);
+    if (pde & PG_PS) {
+        // 4MB大页，没有页表
+        return ((pde & 0xffc00000) + (vaddr & 0x003fffff));
+    }
+
     uint32_t* pte = pte_ptr(vaddr);
     return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
 }
 
-void mem_init(void) {
-    put_str("Init memory start.\n");
-    lock_init(&kernel_pool.lock);
-    lock_init(&user_pool.lock);
-    uint32_t total_memory = (*(uint32_t*) (0xb00));
-    mem_pool_init(total_memory);
+/**
+ * 使vaddr所在页在TLB中的缓存失效.
+ */ 
+static inline void invlpg(uint32_t vaddr) {
+    asm volatile ("invlpg %0" : : "m" (*(char*) vaddr) : "memory");
+}
+
+/**
+ * 重新加载CR3，刷新TLB中所有非全局的缓存，即用户空间的映射.
+ */ 
+static void tlb_flush_all(void) {
+    uint32_t cr3;
+    asm volatile ("movl %%cr3, %0; movl %0, %%cr3" : "=r" (cr3) : : "memory");
+}
+
+/**
+ * 清除再恢复CR4.PGE，连同全局页(内核空间的映射)在内刷新整个TLB.
+ */ 
+static void tlb_flush_global(void) {
+    uint32_t cr4;
+    asm volatile ("movl %%cr4, %0; andl %1, %0; movl %0, %%cr4; orl %2, %0; movl %0, %%cr4"
+                  : "=&r" (cr4) : "i" (~CR4_PGE), "i" (CR4_PGE) : "memory");
+}
+
+/**
+ * 使[vaddr, vaddr + pg_cnt * PAGE_SIZE)的TLB缓存失效，页数较多时退化为整个刷新.
+ */ 
+static void tlb_flush_range(uint32_t vaddr, uint32_t pg_cnt) {
+    if (pg_cnt > TLB_FLUSH_THRESHOLD) {
+        // 内核的映射是全局的，重新加载CR3无法使其失效
+        if (vaddr >= K_VADDR_START) {
+            tlb_flush_global();
+        } else {
+            tlb_flush_all();
+        }
+        return;
+    }
+
+    while (pg_cnt-- > 0) {
+        invlpg(vaddr);
+        vaddr += PAGE_SIZE;
+    }
+}
+
+/**
+ * 释放物理页的一个引用，最后一个引用释放时将其归还到所属的内存池.
+ */ 
+void pfree(uint32_t pg_phy_addr) {
+    if (pg_phy_addr == zero_page_phy) {
+        return;
+    }
+
+    enum intr_status old_status = intr_disable();
+
+    struct page* page = phy_to_page(pg_phy_addr);
+    ASSERT(page->ref_count > 0);
+    if (--page->ref_count == 0) {
+        free_phy_pages(pg_phy_addr, 0);
+    }
+
+    intr_set_status(old_status);
+}
+
+/**
+ * 以4字节为单位清零vaddr处的一页.
+ */ 
+static inline void page_zero(void* vaddr) {
+    uint32_t dummy_edi, dummy_ecx;
+    asm volatile ("cld; rep stosl"
+                  : "=D" (dummy_edi), "=c" (dummy_ecx)
+                  : "0" (vaddr), "1" (PAGE_SIZE / 4), "a" (0)
+                  : "memory");
+}
+
+/**
+ * 通过直接映射区清零物理页.
+ */ 
+static void phy_page_zero(uint32_t pg_phy_addr) {
+    page_zero(phy2virt(pg_phy_addr));
+}
+
+/**
+ * 已清零的页不足时唤醒清零线程.
+ */ 
+static void zeroer_wakeup(struct pool* m_pool) {
+    if (m_pool->clean_count < CLEAN_LOW_WATER && zeroer_waiter != NULL) {
+        thread_unblock(zeroer_waiter);
+        zeroer_waiter = NULL;
+    }
+}
+
+/**
+ * 为pf一方分配一个内容全为0的物理页: 优先从已清零链表中取，取不到时从伙伴系统分配并同步清零.
+ */ 
+static void* palloc_zeroed(enum pool_flags pf) {
+    enum intr_status old_status = intr_disable();
+
+    uint32_t pg_phy_addr = 0;
+    if (!list_empty(&mem_pool.clean_list) && watermark_ok(&mem_pool, pf, 1)) {
+        struct page* page = elem2entry(struct page, free_tag, list_pop(&mem_pool.clean_list));
+        mem_pool.clean_count--;
+        mem_pool.clean_hits++;
+        page_account(&mem_pool, page, pf, 0);
+        pg_phy_addr = page_to_phy(&mem_pool, page);
+    } else {
+        struct page* page = pool_alloc(pf, 0);
+        if (page != NULL) {
+            mem_pool.clean_misses++;
+            pg_phy_addr = page_to_phy(&mem_pool, page);
+            phy_page_zero(pg_phy_addr);
+        }
+    }
+
+    zeroer_wakeup(&mem_pool);
+    intr_set_status(old_status);
+    return (void*) pg_phy_addr;
+}
+
+/**
+ * 从伙伴系统取一页清零后放入已清零链表，清零页已足够或空闲页不高于high水位时返回0，以免与真正的分配争抢.
+ */ 
+static int clean_pool_refill(struct pool* m_pool) {
+    if (m_pool->clean_count >= CLEAN_HIGH_WATER || m_pool->free_page_count <= m_pool->watermark_high) {
+        return 0;
+    }
+
+    struct page* page = buddy_alloc(m_pool, 0);
+    if (page == NULL) {
+        return 0;
+    }
+
+    // 此页已离开伙伴系统，清零时不必关中断
+    phy_page_zero(page_to_phy(m_pool, page));
+
+    enum intr_status old_status = intr_disable();
+    list_append(&m_pool->clean_list, &page->free_tag);
+    m_pool->clean_count++;
+    intr_set_status(old_status);
+    return 1;
+}
+
+/**
+ * 清零线程，在其它任务让出的CPU时间里把空闲页提前清零，没有可做的工作时阻塞.
+ */ 
+static void page_zeroer(void* arg UNUSED) {
+    while (1) {
+        if (!clean_pool_refill(&mem_pool)) {
+            enum intr_status old_status = intr_disable();
+            zeroer_waiter = running_thread();
+            thread_block(TASK_BLOCKED);
+            intr_set_status(old_status);
+        }
+    }
+}
+
+/**
+ * 启动清零线程，依赖线程模块，须在thread_init之后调用.
+ */ 
+void page_zeroer_init(void) {
+    // 时间片只有一个嘀嗒，尽量少占用CPU
+    thread_start("page_zeroer", 1, page_zeroer, NULL);
+}
+
+/**
+ * 打印内存池的使用情况、内存压力以及已清零链表的命中情况.
+ */ 
+void print_mem_pool_stat(void) {
+    put_str("Free pages: ");
+    put_int(mem_pool.free_page_count);
+    put_str("; kernel pages: ");
+    put_int(mem_pool.kernel_pages);
+    put_str("; user pages: ");
+    put_int(mem_pool.user_pages);
+    put_str("\nBelow low watermark: ");
+    put_int(mem_pool.low_events);
+    put_str("; reserve allocs: ");
+    put_int(mem_pool.reserve_allocs);
+    put_str("; user denied: ");
+    put_int(mem_pool.user_denied);
+    put_str("\nClean pages: ");
+    put_int(mem_pool.clean_count);
+    put_str("; hits: ");
+    put_int(mem_pool.clean_hits);
+    put_str("; misses: ");
+    put_int(mem_pool.clean_misses);
+    put_str("; zero page maps: ");
+    put_int(mem_pool.zero_page_maps);
+    put_str("\nSwap outs: ");
+    put_int(mem_pool.swap_outs);
+    put_str("; swap ins: ");
+    put_int(mem_pool.swap_ins);
+    put_str("; free swap slots: ");
+    put_int(swap_free_slots());
+    put_str("\nSwap in cycles avg: ");
+    put_int(mem_pool.swap_in_cycles);
+    put_str("; max: ");
+    put_int(mem_pool.swap_in_cycles_max);
+    put_char('\n');
+    print_ksm_stat();
+    print_zram_stat();
+    put_str("Free kernel virtual pages: ");
+    put_int(kvaddr_free_pages());
+    put_char('\n');
+}
+
+/**
+ * 撤销copy_user_page_tables对child_pgdir中前pde_end个页目录项所做的复制: 归还共享的页和交换槽的引用，释放子进程的页表.
+ * 父进程中已改为只读的页保留PG_COW，写入时发现无人共享便直接恢复可写. 需要持有swap_lock并关中断调用.
+ */ 
+static void child_page_tables_release(uint32_t* child_pgdir, uint32_t pde_end) {
+    uint32_t pde_idx;
+    for (pde_idx = 0; pde_idx < pde_end; pde_idx++) {
+        if (!(child_pgdir[pde_idx] & PG_P_1)) {
+            continue;
+        }
+
+        uint32_t page_table_phyaddr = (child_pgdir[pde_idx] & 0xfffff000);
+        uint32_t* child_page_table = phy2virt(page_table_phyaddr);
+        uint32_t pte_idx;
+        for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+            uint32_t pte = child_page_table[pte_idx];
+            if (pte & PG_P_1) {
+                pfree(pte & 0xfffff000);
+            } else if (pte & PG_SWAP) {
+                swap_slot_put(pte >> 12);
+            }
+        }
+
+        pfree(page_table_phyaddr);
+        child_pgdir[pde_idx] = 0;
+    }
+}
+
+/**
+ * 以写时复制的方式把当前进程的用户空间映射复制到页目录child_pgdir中: 父子进程共享物理页，可写的页在双方都改为只读.
+ * 分配不出页表时撤销已做的复制，返回-1.
+ */ 
+int copy_user_page_tables(uint32_t* child_pgdir) {
+    int ret = 0;
+    // 换出写盘期间不能复制指向该交换槽的页表项，否则写盘失败时无法恢复
+    lock_acquire(&swap_lock);
+    enum intr_status old_status = intr_disable();
+
+    uint32_t pde_idx;
+    for (pde_idx = 0; pde_idx < 0x300; pde_idx++) {
+        uint32_t vaddr = (pde_idx << 22);
+        if (!(*pde_ptr(vaddr) & PG_P_1)) {
+            continue;
+        }
+
+        uint32_t page_table_phyaddr = (uint32_t) palloc(PF_KERNEL);
+        if (page_table_phyaddr == 0) {
+            child_page_tables_release(child_pgdir, pde_idx);
+            ret = -1;
+            break;
+        }
+
+        uint32_t* parent_page_table = pte_ptr(vaddr);
+        uint32_t* child_page_table = phy2virt(page_table_phyaddr);
+
+        uint32_t pte_idx;
+        for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+            uint32_t pte = parent_page_table[pte_idx];
+            if (pte & PG_P_1) {
+                if (pte & PG_RW_W) {
+                    pte = ((pte & ~PG_RW_W) | PG_COW);
+                    parent_page_table[pte_idx] = pte;
+                }
+                if ((pte & 0xfffff000) != zero_page_phy) {
+                    phy_to_page(pte & 0xfffff000)->ref_count++;
+                }
+            } else if (pte & PG_SWAP) {
+                // 换出的页由父子进程共享同一个交换槽，各自换入时得到私有的页
+                swap_slot_dup(pte >> 12);
+            }
+            child_page_table[pte_idx] = pte;
+        }
+
+        child_pgdir[pde_idx] = (page_table_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+    }
+
+    // 父进程的页被改为只读，TLB中可能还缓存着可写的表项
+    tlb_flush_all();
+    intr_set_status(old_status);
+    lock_release(&swap_lock);
+    return ret;
+}
+
+/**
+ * 处理对写时复制页的写操作: 仍被共享时复制一份私有的页，否则直接恢复可写. 内存不足时返回-1.
+ */ 
+static int cow_page_break(uint32_t page_vaddr) {
+    // 分配新页时可能换出页面，其间原页的共享者都退出后原页也可能被换出
+    lock_acquire(&swap_lock);
+
+    uint32_t* pte = pte_ptr(page_vaddr);
+    uint32_t old_phyaddr = (*pte & 0xfffff000);
+    struct page* old_page = phy_to_page(old_phyaddr);
+
+    if (old_phyaddr == zero_page_phy) {
+        // 第一次写入只读过的匿名页，换成一个私有的清零页，不必复制
+        uint32_t new_phyaddr = (uint32_t) palloc_reclaim(PF_USER, 1);
+        if (new_phyaddr == 0) {
+            lock_release(&swap_lock);
+            return -1;
+        }
+
+        *pte = (new_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+        page_rmap_set(phy_to_page(new_phyaddr), page_vaddr);
+    } else if (old_page->ref_count > 1) {
+        uint32_t new_phyaddr = (uint32_t) palloc_reclaim(PF_USER, 0);
+        if (new_phyaddr == 0) {
+            lock_release(&swap_lock);
+            return -1;
+        }
+
+        // 原页仍以只读方式映射在page_vaddr，可以直接读取
+        memcpy(phy2virt(new_phyaddr), (void*) page_vaddr, PAGE_SIZE);
+
+        pfree(old_phyaddr);
+        *pte = (new_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+        page_rmap_set(phy_to_page(new_phyaddr), page_vaddr);
+    } else {
+        enum intr_status old_status = intr_disable();
+        if (old_page->flags & PAGE_KSM) {
+            // 只剩一个映射者，原地写入前先移出稳定表
+            list_remove(&old_page->free_tag);
+            old_page->flags &= ~PAGE_KSM;
+        }
+        *pte = ((*pte | PG_RW_W) & ~PG_COW);
+        // 其它共享者都已退出，此页此后归当前进程所有
+        page_rmap_set(old_page, page_vaddr);
+        intr_set_status(old_status);
+    }
+
+    invlpg(page_vaddr);
+    lock_release(&swap_lock);
+    return 0;
+}
+
+/**
+ * 在虚拟地址池中释放以_vaddr起始的pg_cnt个虚拟页.
+ */ 
+static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
+    uint32_t vaddr = (uint32_t) _vaddr;
+
+    if (pf == PF_USER) {
+        if (vma_unmap(&running_thread()->vm_space, vaddr, vaddr + pg_cnt * PAGE_SIZE) == -1) {
+            PANIC("vaddr_remove: out of kernel memory!");
+        }
+        return;
+    }
+
+    kvaddr_free(vaddr, pg_cnt);
+}
+
+/**
+ * 释放空的用户页表，返回释放的页表个数. 内核页表被所有进程共享，不能释放.
+ */ 
+static uint32_t page_table_release(uint32_t vaddr_start, uint32_t vaddr_end) {
+    uint32_t released = 0, pde_idx, vaddr_last = vaddr_end - 1;
+
+    for (pde_idx = PDE_INDEX(vaddr_start); pde_idx <= PDE_INDEX(vaddr_last) && pde_idx < 0x300; pde_idx++) {
+        uint32_t vaddr = (pde_idx << 22);
+        uint32_t* pde = pde_ptr(vaddr);
+        if (!(*pde & PG_P_1)) {
+            continue;
+        }
+
+        uint32_t* page_table = pte_ptr(vaddr);
+        uint32_t pte_idx = 0;
+        while (pte_idx < 1024 && page_table[pte_idx] == 0) {
+            ++pte_idx;
+        }
+
+        if (pte_idx == 1024) {
+            pfree(*pde & 0xfffff000);
+            *pde = 0;
+            // 页表本身通过页目录最后一项映射在(0xffc00000 + pde_idx * 4KB)处
+            invlpg((uint32_t) page_table);
+            ++released;
+        }
+    }
+
+    return released;
+}
+
+/**
+ * 释放以_vaddr起始的pg_cnt个页: 归还物理页，清除页表项，归还虚拟地址，回收空的用户页表，最后批量刷新TLB.
+ */ 
+void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
+    uint32_t vaddr = (uint32_t) _vaddr, count = 0;
+    ASSERT(pg_cnt >= 1 && (vaddr % PAGE_SIZE) == 0);
+
+    if (pf == PF_KERNEL && vaddr >= K_VADDR_START && vaddr < direct_map_end) {
+        // 直接映射区的映射始终存在，只需归还物理页，也不用刷新TLB
+        while (count < pg_cnt) {
+            pfree(vaddr - K_VADDR_START + count * PAGE_SIZE);
+            ++count;
+        }
+        return;
+    }
+
+    if (pf == PF_USER) {
+        // 不能与换出同时修改页表
+        lock_acquire(&swap_lock);
+    }
+
+    while (count < pg_cnt) {
+        uint32_t page_vaddr = vaddr + count * PAGE_SIZE;
+        uint32_t* pte = pte_ptr(page_vaddr);
+
+        // 页表或页可能从未建立，页也可能已被换出
+        if (*pde_ptr(page_vaddr) & PG_P_1) {
+            if (*pte & PG_P_1) {
+                pfree(*pte & 0xfffff000);
+            } else if (*pte & PG_SWAP) {
+                swap_slot_put(*pte >> 12);
+            }
+            *pte = 0;
+        }
+        ++count;
+    }
+
+    vaddr_remove(pf, _vaddr, pg_cnt);
+
+    if (pf == PF_USER) {
+        page_table_release(vaddr, vaddr + pg_cnt * PAGE_SIZE);
+        lock_release(&swap_lock);
+    }
+
+    tlb_flush_range(vaddr, pg_cnt);
+}
+
+/**
+ * 释放当前进程的整个用户空间: 归还物理页和交换槽，释放用户页表，页目录的用户部分随之清空.
+ */ 
+void user_space_release(void) {
+    struct task_struct* cur = running_thread();
+    // 不能与换出、KSM同时修改页表
+    lock_acquire(&swap_lock);
+
+    uint32_t pde_idx;
+    for (pde_idx = 0; pde_idx < 0x300; pde_idx++) {
+        uint32_t vaddr = (pde_idx << 22);
+        uint32_t* pde = pde_ptr(vaddr);
+        if (!(*pde & PG_P_1)) {
+            continue;
+        }
+
+        uint32_t* page_table = pte_ptr(vaddr);
+        uint32_t pte_idx;
+        for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+            uint32_t pte = page_table[pte_idx];
+            if (pte & PG_P_1) {
+                enum intr_status old_status = intr_disable();
+                // 仍被其它进程共享的页，反向映射不能再指向即将回收的PCB
+                struct page* page = phy_to_page(pte & 0xfffff000);
+                if (page->owner == cur) {
+                    page->owner = NULL;
+                }
+                pfree(pte & 0xfffff000);
+                intr_set_status(old_status);
+            } else if (pte & PG_SWAP) {
+                swap_slot_put(pte >> 12);
+            }
+        }
+
+        // 页表整页归还，其中的表项不必清零
+        pfree(*pde & 0xfffff000);
+        *pde = 0;
+    }
+
+    tlb_flush_all();
+    lock_release(&swap_lock);
+}
+
+/**
+ * 找到用户页唯一的页表项: 页只被一个进程映射，且其所有者在记录的地址上确实映射着此页，否则返回NULL. 需要关中断调用.
+ */ 
+static uint32_t* page_rmap_pte(struct page* page) {
+    if (!(page->flags & PAGE_USER) || page->owner == NULL || page->ref_count != 1 || page->owner->pgdir == NULL) {
+        return NULL;
+    }
+
+    // 所有者的页目录和页表都在直接映射区中，不必切换地址空间
+    uint32_t pde = page->owner->pgdir[PDE_INDEX(page->vaddr)];
+    if (!(pde & PG_P_1)) {
+        return NULL;
+    }
+
+    uint32_t* pte = (uint32_t*) phy2virt(pde & 0xfffff000) + PTE_INDEX(page->vaddr);
+    if ((*pte & (0xfffff000 | PG_P_1)) != (page_to_phy(&mem_pool, page) | PG_P_1)) {
+        return NULL;
+    }
+    return pte;
+}
+
+/**
+ * 时钟算法换出一个用户页: 从时钟指针处依次检查，最近被访问过的页清除访问位再给一次机会. 换出一页返回1，
+ * 交换区已满、写盘失败或扫描两圈仍没有可换出的页时返回0. 需持有swap_lock.
+ */ 
+static int page_swap_out(void) {
+    uint32_t scanned;
+    for (scanned = 0; scanned < 2 * mem_pool.page_count; scanned++) {
+        enum intr_status old_status = intr_disable();
+
+        struct page* page = &mem_pool.pages[mem_pool.clock_hand];
+        if (++mem_pool.clock_hand == mem_pool.page_count) {
+            mem_pool.clock_hand = 0;
+        }
+
+        uint32_t* pte = page_rmap_pte(page);
+        if (pte == NULL) {
+            intr_set_status(old_status);
+            continue;
+        }
+
+        uint32_t vaddr = page->vaddr;
+        if (*pte & PG_A) {
+            *pte &= ~PG_A;
+            // 所有者的页目录可能正被加载着，TLB中缓存的表项不会再次设置访问位
+            invlpg(vaddr);
+            intr_set_status(old_status);
+            continue;
+        }
+
+        // 换入后没有被写过的页，交换区中的副本仍然有效
+        uint32_t slot = page->swap_slot, old_pte = *pte;
+        int need_write = (slot == 0 || (old_pte & PG_D));
+        if (slot == 0 && (slot = swap_slot_alloc()) == 0) {
+            intr_set_status(old_status);
+            return 0;
+        }
+
+        // 先解除映射，写盘期间所有者再访问此页会在swap_in中等待swap_lock
+        *pte = ((slot << 12) | PG_SWAP);
+        invlpg(vaddr);
+        page->swap_slot = 0;
+        intr_set_status(old_status);
+
+        uint32_t pg_phy_addr = page_to_phy(&mem_pool, page);
+        if (need_write && swap_write(slot, phy2virt(pg_phy_addr)) == -1) {
+            // 恢复映射，持有swap_lock，其间没有人能复制或释放换出的页表项
+            old_status = intr_disable();
+            ASSERT(swap_slot_count(slot) == 1);
+            *pte = old_pte;
+            swap_slot_put(slot);
+            intr_set_status(old_status);
+            return 0;
+        }
+
+        pfree(pg_phy_addr);
+        mem_pool.swap_outs++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * 换出用户页，直到空闲页(含已清零的页)不少于target或无页可换，返回换出的页数. 可能阻塞.
+ */ 
+static uint32_t page_reclaim(uint32_t target) {
+    uint32_t reclaimed = 0;
+
+    lock_acquire(&swap_lock);
+    while (mem_pool.free_page_count + mem_pool.clean_count < target && page_swap_out()) {
+        ++reclaimed;
+    }
+    lock_release(&swap_lock);
+
+    return reclaimed;
+}
+
+/**
+ * 为pf一方分配一个物理页，失败时同步换出一批用户页再试一次. 可能阻塞.
+ */ 
+static void* palloc_reclaim(enum pool_flags pf, uint8_t zero) {
+    void* pg_phy_addr = (zero ? palloc_zeroed(pf) : palloc(pf));
+    if (pg_phy_addr == NULL && page_reclaim(mem_pool.watermark_low) > 0) {
+        pg_phy_addr = (zero ? palloc_zeroed(pf) : palloc(pf));
+    }
+
+    return pg_phy_addr;
+}
+
+/**
+ * 把换出到交换区的页读回新分配的物理页，重新映射到page_vaddr. 内存不足或读盘失败时返回-1，页表项保持换出状态.
+ */ 
+static int swap_in(uint32_t page_vaddr) {
+    lock_acquire(&swap_lock);
+
+    uint32_t* pte = pte_ptr(page_vaddr);
+    if (!(*pte & PG_P_1) && (*pte & PG_SWAP)) {
+        uint64_t start = rdtsc();
+        uint32_t slot = (*pte >> 12);
+        uint32_t pg_phy_addr = (uint32_t) palloc_reclaim(PF_USER, 0);
+        if (pg_phy_addr == 0) {
+            lock_release(&swap_lock);
+            return -1;
+        }
+        if (swap_read(slot, phy2virt(pg_phy_addr)) == -1) {
+            pfree(pg_phy_addr);
+            lock_release(&swap_lock);
+            return -1;
+        }
+
+        struct page* page = phy_to_page(pg_phy_addr);
+        if (swap_slot_count(slot) == 1 && swap_slot_on_disk(slot)) {
+            // 硬盘上的副本留给此页，再次换出前没被写过就不必写盘. zram中的副本要占内存，直接释放
+            page->swap_slot = slot;
+        } else {
+            swap_slot_put(slot);
+        }
+
+        *pte = (pg_phy_addr | PG_US_U | PG_RW_W | PG_P_1);
+        page_rmap_set(page, page_vaddr);
+        mem_pool.swap_ins++;
+
+        uint32_t cycles = (uint32_t) (rdtsc() - start);
+        mem_pool.swap_in_cycles = (mem_pool.swap_in_cycles == 0 ? cycles : mem_pool.swap_in_cycles - (mem_pool.swap_in_cycles >> 3) + (cycles >> 3));
+        if (cycles > mem_pool.swap_in_cycles_max) {
+            mem_pool.swap_in_cycles_max = cycles;
+        }
+    }
+
+    lock_release(&swap_lock);
+    return 0;
+}
+
+/**
+ * 回收线程，空闲页低于low水位时被唤醒，换出最近未被访问的用户页直到high水位.
+ */ 
+static void page_reclaimer(void* arg UNUSED) {
+    while (1) {
+        page_reclaim(mem_pool.watermark_high);
+
+        enum intr_status old_status = intr_disable();
+        reclaimer_waiter = running_thread();
+        thread_block(TASK_BLOCKED);
+        intr_set_status(old_status);
+    }
+}
+
+/**
+ * 启动回收线程，须在thread_init和swap_init之后调用.
+ */ 
+void page_reclaimer_init(void) {
+    thread_start("page_reclaimer", 8, page_reclaimer, NULL);
+}
+
+/**
+ * 计算一页内容的FNV-1a哈希(按4字节计算)，0留作没有记录.
+ */ 
+static uint32_t ksm_page_hash(const uint32_t* words) {
+    uint32_t hash = 2166136261u, idx;
+    for (idx = 0; idx < PAGE_SIZE / 4; idx++) {
+        hash = (hash ^ words[idx]) * 16777619u;
+    }
+    return (hash == 0 ? 1 : hash);
+}
+
+/**
+ * 在哈希桶bucket中查找哈希为hash且内容与物理页pg_phy_addr完全相同的页，找不到返回NULL. 需要关中断调用.
+ */ 
+static struct page* ksm_lookup(struct list* bucket, uint32_t hash, uint32_t pg_phy_addr) {
+    struct list_elem* elem = bucket->head.next;
+    while (elem != &bucket->tail) {
+        struct page* page = elem2entry(struct page, free_tag, elem);
+        if (page->ksm_hash == hash
+            && memcmp(phy2virt(page_to_phy(&mem_pool, page)), phy2virt(pg_phy_addr), PAGE_SIZE) == 0) {
+            return page;
+        }
+        elem = elem->next;
+    }
+    return NULL;
+}
+
+/**
+ * 写保护后的页表项: 原本可写或写时复制的页改为写时复制，只读的页保持只读.
+ */ 
+static uint32_t ksm_pte_protect(uint32_t pte, uint32_t pg_phy_addr) {
+    return (pg_phy_addr | PG_US_U | PG_P_1 | ((pte & (PG_RW_W | PG_COW)) ? PG_COW : 0));
+}
+
+/**
+ * 把候选页cand转为稳定表中的共享页，其页表项cand_pte改为写保护. 需要关中断调用.
+ */ 
+static void ksm_stabilize(struct page* cand, uint32_t* cand_pte) {
+    list_remove(&cand->free_tag);
+    cand->flags = ((cand->flags & ~PAGE_KSM_CAND) | PAGE_KSM);
+    list_append(&ksm_stable[cand->ksm_hash % KSM_HASH_BUCKETS], &cand->free_tag);
+
+    if ((*cand_pte & PG_D) && cand->swap_slot != 0) {
+        // 换入后被写过，交换区中的副本已过期，而写保护后的表项不再记录脏位
+        swap_slot_put(cand->swap_slot);
+        cand->swap_slot = 0;
+    }
+    *cand_pte = ksm_pte_protect(*cand_pte, page_to_phy(&mem_pool, cand));
+    invlpg(cand->vaddr);
+}
+
+/**
+ * 把映射在pte处的私有页page换成内容相同的共享页kpage，释放page. 需要关中断调用.
+ */ 
+static void ksm_merge(struct page* page, uint32_t* pte, struct page* kpage) {
+    uint32_t pg_phy_addr = page_to_phy(&mem_pool, page);
+
+    *pte = ksm_pte_protect(*pte, page_to_phy(&mem_pool, kpage));
+    // 扫描线程的页目录可能是此页所有者的，其TLB中仍缓存着原来的表项
+    invlpg(page->vaddr);
+    kpage->ref_count++;
+    pfree(pg_phy_addr);
+    mem_pool.ksm_merges++;
+}
+
+/**
+ * 扫描一个页: 内容与上一轮相同时先与稳定表中的共享页合并，再与不稳定表中的候选页合并，都不成则自身成为候选页.
+ */ 
+static void ksm_scan_page(struct page* page) {
+    // 只考虑只被一个进程映射的用户页，已在表中的页本轮不再扫描
+    if (!(page->flags & PAGE_USER) || (page->flags & (PAGE_KSM | PAGE_KSM_CAND)) || page->ref_count != 1) {
+        return;
+    }
+
+    // 哈希只是提示，计算期间页可能被写入或释放，合并前会在关中断下逐字节比较
+    uint32_t pg_phy_addr = page_to_phy(&mem_pool, page);
+    uint32_t hash = ksm_page_hash(phy2virt(pg_phy_addr));
+
+    lock_acquire(&swap_lock);
+    enum intr_status old_status = intr_disable();
+
+    uint32_t* pte = page_rmap_pte(page);
+    if (pte == NULL) {
+        intr_set_status(old_status);
+        lock_release(&swap_lock);
+        return;
+    }
+
+    if (hash != page->ksm_hash) {
+        // 内容还在变化，下一轮再看
+        page->ksm_hash = hash;
+        intr_set_status(old_status);
+        lock_release(&swap_lock);
+        return;
+    }
+
+    uint32_t bucket = hash % KSM_HASH_BUCKETS;
+    struct page* kpage = ksm_lookup(&ksm_stable[bucket], hash, pg_phy_addr);
+    if (kpage != NULL) {
+        ksm_merge(page, pte, kpage);
+    } else {
+        kpage = ksm_lookup(&ksm_unstable[bucket], hash, pg_phy_addr);
+        // 候选页加入不稳定表后可能已被fork共享
+        uint32_t* kpte = (kpage == NULL ? NULL : page_rmap_pte(kpage));
+        if (kpte != NULL) {
+            ksm_stabilize(kpage, kpte);
+            ksm_merge(page, pte, kpage);
+        } else {
+            page->flags |= PAGE_KSM_CAND;
+            list_append(&ksm_unstable[bucket], &page->free_tag);
+        }
+    }
+
+    intr_set_status(old_status);
+    lock_release(&swap_lock);
+}
+
+/**
+ * 一轮扫描结束，清空不稳定表，候选页的内容随时可能改变，下一轮重新建立.
+ */ 
+static void ksm_unstable_flush(void) {
+    uint32_t bucket;
+    for (bucket = 0; bucket < KSM_HASH_BUCKETS; bucket++) {
+        enum intr_status old_status = intr_disable();
+        while (!list_empty(&ksm_unstable[bucket])) {
+            struct page* page = elem2entry(struct page, free_tag, list_pop(&ksm_unstable[bucket]));
+            page->flags &= ~PAGE_KSM_CAND;
+        }
+        intr_set_status(old_status);
+    }
+}
+
+/**
+ * KSM扫描线程，把不同进程中内容相同的用户页合并为一个只读的共享页，写入时通过写时复制分开.
+ * 新分配的用户页足够多时被唤醒.
+ */ 
+static void ksm_scanner(void* arg UNUSED) {
+    while (1) {
+        // 页的内容要在相邻两轮中保持不变才能合并，每次被唤醒至少扫描两轮，仍有合并时继续
+        uint32_t passes = 0, merges, merges_before = mem_pool.ksm_merges;
+        do {
+            merges = mem_pool.ksm_merges;
+            mem_pool.ksm_new_pages = 0;
+
+            uint32_t idx;
+            for (idx = 0; idx < mem_pool.page_count; idx++) {
+                ksm_scan_page(&mem_pool.pages[idx]);
+            }
+            ksm_unstable_flush();
+        } while (++passes < 2 || mem_pool.ksm_merges != merges);
+
+        // 这次唤醒有新的合并时报告一次
+        if (mem_pool.ksm_merges != merges_before) {
+            console_acquire();
+            print_ksm_stat();
+            console_release();
+        }
+
+        enum intr_status old_status = intr_disable();
+        ksm_waiter = running_thread();
+        thread_block(TASK_BLOCKED);
+        intr_set_status(old_status);
+    }
+}
+
+/**
+ * 启动KSM扫描线程，须在thread_init之后调用.
+ */ 
+void ksm_init(void) {
+    uint32_t bucket;
+    for (bucket = 0; bucket < KSM_HASH_BUCKETS; bucket++) {
+        list_init(&ksm_stable[bucket]);
+        list_init(&ksm_unstable[bucket]);
+    }
+
+    // 时间片只有一个嘀嗒，只利用空闲的CPU
+    thread_start("ksm_scanner", 1, ksm_scanner, NULL);
+}
+
+/**
+ * 打印KSM共享页的个数以及由此节省的物理页数.
+ */ 
+static void print_ksm_stat(void) {
+    uint32_t shared = 0, saved = 0, bucket;
+
+    enum intr_status old_status = intr_disable();
+    for (bucket = 0; bucket < KSM_HASH_BUCKETS; bucket++) {
+        struct list_elem* elem = ksm_stable[bucket].head.next;
+        while (elem != &ksm_stable[bucket].tail) {
+            struct page* page = elem2entry(struct page, free_tag, elem);
+            ++shared;
+            saved += page->ref_count - 1;
+            elem = elem->next;
+        }
+    }
+    intr_set_status(old_status);
+
+    put_str("KSM shared pages: ");
+    put_int(shared);
+    put_str("; saved pages: ");
+    put_int(saved);
+    put_str("; merges: ");
+    put_int(mem_pool.ksm_merges);
+    put_char('\n');
+}
+
+/**
+ * 判断进程对用户地址vaddr的缺页能否按需分配: 已申请的虚拟页，或者紧挨栈顶之下的栈增长区域.
+ */ 
+static int user_vaddr_demand(struct task_struct* cur, uint32_t vaddr, uint32_t err_code, struct intr_stack* stack) {
+    if (vaddr < cur->vm_space.vaddr_start || vaddr >= 0xc0000000) {
+        return 0;
+    }
+
+    if (vma_find(&cur->vm_space, vaddr) != NULL) {
+        return 1;
+    }
+
+    if (vaddr < 0xc0000000 - USER_STACK_MAX_SIZE) {
+        return 0;
+    }
+
+    // 用户态访问时CPU压入了用户栈的esp，只允许在其附近增长
+    if ((err_code & PF_ERR_U) && vaddr + STACK_GROWTH_SLACK < (uint32_t) stack->esp) {
+        return 0;
+    }
+
+    // 与原有的栈区域相邻时会合并
+    uint32_t page_vaddr = (vaddr & 0xfffff000);
+    return vma_map(&cur->vm_space, page_vaddr, page_vaddr + PAGE_SIZE, VM_WRITE | VM_STACK) == 0;
+}
+
+/**
+ * 缺页中断处理: 为用户进程按需分配匿名页，读缺页映射共享的零页，写缺页分配清零的私有页，无法处理时打印出错地址，
+ * 用户态的非法访问结束该进程，否则停机.
+ */ 
+static void page_fault_handler(uint8_t vec_nr, struct intr_stack* stack) {
+    uint32_t vaddr;
+    asm ("movl %%cr2, %0" : "=r" (vaddr));
+
+    struct task_struct* cur = running_thread();
+    uint32_t err_code = stack->err_code;
+
+    // 用户空间的缺页因内存不足无法处理时，无论发生在用户态还是内核态都只结束该进程
+    int out_of_memory = 0;
+    if ((err_code & PF_ERR_P) && (err_code & PF_ERR_W) && cur->pgdir != NULL && vaddr < 0xc0000000
+        && (*pte_ptr(vaddr) & PG_COW)) {
+        if (cow_page_break(vaddr & 0xfffff000) == 0) {
+            return;
+        }
+        out_of_memory = 1;
+    } else if (!(err_code & PF_ERR_P) && cur->pgdir != NULL && vaddr < 0xc0000000 && (*pde_ptr(vaddr) & PG_P_1)
+        && (*pte_ptr(vaddr) & PG_SWAP)) {
+        if (swap_in(vaddr & 0xfffff000) == 0) {
+            return;
+        }
+        out_of_memory = 1;
+    } else if (!(err_code & PF_ERR_P) && cur->pgdir != NULL && user_vaddr_demand(cur, vaddr, err_code, stack)) {
+        if (!(err_code & PF_ERR_W)) {
+            // 读缺页先映射只读的零页，第一次写入时再通过写时复制分配私有页
+            uint32_t* pte = pte_create(vaddr);
+            if (pte != NULL) {
+                *pte = (zero_page_phy | PG_US_U | PG_P_1 | PG_COW);
+                mem_pool.zero_page_maps++;
+                return;
+            }
+        } else {
+            void* page_phyaddr = palloc_reclaim(PF_USER, 1);
+            if (page_phyaddr != NULL) {
+                if (page_table_add((void*) (vaddr & 0xfffff000), page_phyaddr) == 0) {
+                    return;
+                }
+                pfree((uint32_t) page_phyaddr);
+            }
+        }
+        // 内存不足，连页表都分配不出来
+        out_of_memory = 1;
+    }
+
+    if (out_of_memory) {
+        put_str("\nOut of memory!");
+    }
+
+    put_str("\nPage fault address is: ");
+    put_int(vaddr);
+    put_str(", vector: ");
+    put_int(vec_nr);
+    put_str(", error code: ");
+    put_int(err_code);
+    put_char('\n');
+
+    if (cur->pgdir != NULL && ((err_code & PF_ERR_U) || out_of_memory)) {
+        // 用户进程的非法访问只结束该进程
+        put_str("Process killed: ");
+        put_str(cur->name);
+        put_char('\n');
+        thread_exit();
+    }
+    PANIC("page_fault_handler: unresolvable page fault!");
+}
+
+/**
+ * 初始化各规格的内存块描述符.
+ */ 
+void block_desc_init(struct mem_block_desc* desc_array) {
+    uint32_t desc_idx, block_size = 16;
+
+    for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+        desc_array[desc_idx].block_size = block_size;
+        desc_array[desc_idx].blocks_per_arena = (PAGE_SIZE - sizeof(struct arena)) / block_size;
+        desc_array[desc_idx].free_cnt = 0;
+        list_init(&desc_array[desc_idx].free_list);
+        block_size *= 2;
+    }
+}
+
+/**
+ * 返回arena中第idx个内存块的地址.
+ */ 
+static struct mem_block* arena2block(struct arena* a, uint32_t idx) {
+    return (struct mem_block*) ((uint32_t) a + sizeof(struct arena) + idx * a->desc->block_size);
+}
+
+/**
+ * 返回内存块所在的arena.
+ */ 
+static struct arena* block2arena(struct mem_block* b) {
+    return (struct arena*) ((uint32_t) b & 0xfffff000);
+}
+
+/**
+ * 在内核堆中申请size字节的内存，不大于2048字节时从对应规格的空闲链表中取一块，否则直接分配整页.
+ */ 
+void* kmalloc(uint32_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    struct arena* a;
+
+    if (size > k_block_descs[DESC_CNT - 1].block_size) {
+        // 大块内存，arena元信息也要占用空间. 整页分配可能引起回收而阻塞，不能关中断
+        uint32_t page_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PAGE_SIZE);
+        a = get_kernel_pages(page_cnt);
+        if (a == NULL) {
+            return NULL;
+        }
+
+        a->desc = NULL;
+        a->cnt = page_cnt;
+        a->large = 1;
+        return (void*) (a + 1);
+    }
+
+    uint32_t desc_idx = 0;
+    while (k_block_descs[desc_idx].block_size < size) {
+        ++desc_idx;
+    }
+    struct mem_block_desc* desc = &k_block_descs[desc_idx];
+
+    enum intr_status old_status = intr_disable();
+    if (list_empty(&desc->free_list)) {
+        // 没有可用的内存块，新建一个arena并将其划分为内存块. 申请页可能引起回收(换出、等待swap_lock)，
+        // 先恢复中断，期间其它任务可能已补充了此规格，新的arena照样并入空闲链表
+        intr_set_status(old_status);
+        a = get_kernel_pages(1);
+        if (a == NULL) {
+            return NULL;
+        }
+        intr_disable();
+
+        a->desc = desc;
+        a->cnt = desc->blocks_per_arena;
+        a->large = 0;
+
+        uint32_t block_idx;
+        for (block_idx = 0; block_idx < desc->blocks_per_arena; block_idx++) {
+            list_append(&desc->free_list, &arena2block(a, block_idx)->free_elem);
+        }
+        desc->free_cnt += desc->blocks_per_arena;
+    }
+
+    struct mem_block* b = elem2entry(struct mem_block, free_elem, list_pop(&desc->free_list));
+    block2arena(b)->cnt--;
+    desc->free_cnt--;
+
+    intr_set_status(old_status);
+    return (void*) b;
+}
+
+/**
+ * 释放kmalloc申请的内存.
+ */ 
+void kfree(void* ptr) {
+    ASSERT(ptr != NULL);
+
+    enum intr_status old_status = intr_disable();
+
+    struct mem_block* b = ptr;
+    struct arena* a = block2arena(b);
+
+    if (a->large) {
+        mfree_page(PF_KERNEL, a, a->cnt);
+        intr_set_status(old_status);
+        return;
+    }
+
+    struct mem_block_desc* desc = a->desc;
+    list_push(&desc->free_list, &b->free_elem);
+    desc->free_cnt++;
+
+    // arena已全部空闲，且此规格还有其它空闲块时才归还，避免反复申请释放同一个arena
+    if (++a->cnt == desc->blocks_per_arena && desc->free_cnt > desc->blocks_per_arena) {
+        uint32_t block_idx;
+        for (block_idx = 0; block_idx < desc->blocks_per_arena; block_idx++) {
+            list_remove(&arena2block(a, block_idx)->free_elem);
+        }
+        desc->free_cnt -= desc->blocks_per_arena;
+        mfree_page(PF_KERNEL, a, 1);
+    }
+
+    intr_set_status(old_status);
+}
+
+void mem_init(void) {
+    put_str("Init memory start.\n");
+    lock_init(&mem_pool.lock);
+    lock_init(&swap_lock);
+    mem_pool_init();
+    block_desc_init(k_block_descs);
+    register_handler(0x0e, page_fault_handler);
+
+    zero_page_phy = (uint32_t) palloc_zeroed(PF_KERNEL);
+    if (zero_page_phy == 0) {
+        PANIC("mem_init: no page for the zero page!");
+    }
+
+    // 打开CR0的WP位，内核写只读的用户页(写时复制)时同样触发缺页中断
+    uint32_t cr0;
+    asm volatile ("movl %%cr0, %0; orl %1, %0; movl %0, %%cr0" : "=&r" (cr0) : "i" (CR0_WP) : "memory");
     put_str("Init memory done.\n");
 }
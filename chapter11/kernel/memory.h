@@ -2,7 +2,7 @@
 # define _KERNEL_MEMORY_H
 
 # include "stdint.h"
-# include "bitmap.h"
+# include "kernel/list.h"
 
 // 存在标志
 # define PG_P_1 1
@@ -14,6 +14,20 @@
 // 系统级
 # define PG_US_S 0
 # define PG_US_U 4
+// 访问位和脏位，由CPU在访问和写入页时置位
+# define PG_A 0x20
+# define PG_D 0x40
+// 页目录项直接映射4MB的大页
+# define PG_PS 0x80
+// 全局页，内核空间的映射使用，重新加载CR3时不会被刷新
+# define PG_G 0x100
+// 页表项中留给软件使用的位，标记写时复制的只读页
+# define PG_COW 0x200
+// 不存在的页表项中标记此页已换出，高20位为交换槽号
+# define PG_SWAP 0x400
+
+// 内核空间的起始虚拟地址，其上的映射为所有进程共享. 内存池的物理地址p线性映射在K_VADDR_START + p处(直接映射区)
+# define K_VADDR_START 0xc0000000
 
 /**
  * 内存池类型标志.
@@ -21,16 +35,35 @@
 enum pool_flags {
     // 内核类型
     PF_KERNEL = 1,
-    PF_USER = 2
+    PF_USER = 2,
+    // 与PF_KERNEL合用: 不动用min水位之下的保留页，用于换出路径上本为腾出内存而做的分配
+    PF_NORESERVE = 4
 };
 
-struct virtual_addr {
-    struct bitmap vaddr_bitmap;
-    // 虚拟内存的起始地址
-    uint32_t vaddr_start;
+/**
+ * 内存块，空闲时作为空闲链表的节点.
+ */ 
+struct mem_block {
+    struct list_elem free_elem;
 };
 
-extern struct pool kernel_pool, user_pool;
+/**
+ * 内存块描述符，每种规格的内存块对应一个.
+ */ 
+struct mem_block_desc {
+    // 内存块大小
+    uint32_t block_size;
+    // 一个arena可以容纳的内存块数
+    uint32_t blocks_per_arena;
+    // 空闲链表中的内存块数
+    uint32_t free_cnt;
+    struct list free_list;
+};
+
+// 内存块规格数: 16, 32, 64, 128, 256, 512, 1024, 2048字节
+# define DESC_CNT 8
+
+extern struct pool mem_pool;
 
 void mem_init(void);
 void* get_kernel_pages(uint32_t page_count);
@@ -38,5 +71,25 @@ void* malloc_page(enum pool_flags pf, uint32_t page_count);
 uint32_t addr_v2p(uint32_t vaddr);
 void* get_a_page(enum pool_flags pf, uint32_t vaddr);
 void* get_user_pages(uint32_t page_count);
+void* alloc_phy_pages(enum pool_flags pf, uint32_t order);
+void free_phy_pages(uint32_t pg_phy_addr, uint32_t order);
+void pfree(uint32_t pg_phy_addr);
+void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
+int copy_user_page_tables(uint32_t* child_pgdir);
+void user_space_release(void);
+void block_desc_init(struct mem_block_desc* desc_array);
+void* kmalloc(uint32_t size);
+void kfree(void* ptr);
+void page_zeroer_init(void);
+void page_reclaimer_init(void);
+void ksm_init(void);
+void print_mem_pool_stat(void);
+
+/**
+ * 内存池中的物理地址在直接映射区中的虚拟地址.
+ */ 
+static inline void* phy2virt(uint32_t phy_addr) {
+    return (void*) (K_VADDR_START + phy_addr);
+}
 
 # endif
\ No newline at end of file
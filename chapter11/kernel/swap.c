@@ -0,0 +1,189 @@
+# include "swap.h"
+# include "ata.h"
+# include "zram.h"
+# include "memory.h"
+# include "global.h"
+# include "string.h"
+# include "debug.h"
+# include "interrupt.h"
+# include "kernel/print.h"
+
+# define PAGE_SIZE 4096
+# define SECTORS_PER_SLOT (PAGE_SIZE / SECTOR_SIZE)
+
+// 交换区在ata0-master上的位置: 跳过前1MB(MBR、loader和内核)，最多8MB，硬盘较小时只有前面的槽有硬盘空间
+# define SWAP_START_SECTOR 2048
+# define SWAP_SECTORS_MAX 16384
+# define SWAP_SLOTS (SWAP_SECTORS_MAX / SECTORS_PER_SLOT)
+
+// zram最多占用的物理页数，32MB的配置下为内存的1/4
+# define ZRAM_PAGES_MAX 2048
+
+// 交换槽的最大引用数，fork后父子进程的页表项可能指向同一个槽
+# define SWAP_COUNT_MAX 0xff
+
+/**
+ * 交换槽. 换出的页优先压缩后保存在zram中，压缩效果不好时才写入硬盘.
+ */ 
+struct swap_slot {
+    // 引用计数，0表示空闲
+    uint8_t count;
+    uint8_t in_zram;
+    uint16_t zram_len;
+    void* zram_handle;
+};
+
+// 0号槽不使用，换出的页表项因此永远不为0
+static struct swap_slot* swap_map;
+static uint32_t swap_slots;
+// 有硬盘空间的槽数
+static uint32_t disk_slots;
+static uint32_t free_slots;
+// 下一次从此处开始查找空闲槽
+static uint32_t next_slot;
+
+/**
+ * 初始化交换区和zram. 没有硬盘时只能换出到zram. 依赖kmalloc和ata_init，须在其后调用.
+ */ 
+void swap_init(void) {
+    put_str("swap_init start.\n");
+
+    uint32_t sectors = ata_sector_count();
+    disk_slots = 0;
+    if (sectors > SWAP_START_SECTOR) {
+        sectors -= SWAP_START_SECTOR;
+        disk_slots = (sectors < SWAP_SECTORS_MAX ? sectors : SWAP_SECTORS_MAX) / SECTORS_PER_SLOT;
+    }
+
+    swap_slots = SWAP_SLOTS;
+    swap_map = kmalloc(swap_slots * sizeof(struct swap_slot));
+    ASSERT(swap_map != NULL);
+    memset(swap_map, 0, swap_slots * sizeof(struct swap_slot));
+    free_slots = swap_slots - 1;
+    next_slot = 1;
+
+    zram_init(ZRAM_PAGES_MAX);
+
+    put_str("swap slots: ");
+    put_int(free_slots);
+    put_str("; on disk: ");
+    put_int(disk_slots);
+    put_str("\nswap_init done.\n");
+}
+
+/**
+ * 丢弃槽中保存在zram中的数据.
+ */ 
+static void swap_slot_zram_drop(struct swap_slot* sslot) {
+    if (sslot->in_zram) {
+        zram_free(sslot->zram_handle, sslot->zram_len);
+        sslot->in_zram = 0;
+    }
+}
+
+/**
+ * 分配一个交换槽，引用计数为1，交换区已满时返回0.
+ */ 
+uint32_t swap_slot_alloc(void) {
+    enum intr_status old_status = intr_disable();
+
+    uint32_t slot = 0, scanned;
+    for (scanned = 0; scanned < swap_slots && free_slots > 0; scanned++) {
+        uint32_t candidate = next_slot;
+        if (++next_slot == swap_slots) {
+            next_slot = 1;
+        }
+
+        if (swap_map[candidate].count == 0) {
+            swap_map[candidate].count = 1;
+            --free_slots;
+            slot = candidate;
+            break;
+        }
+    }
+
+    intr_set_status(old_status);
+    return slot;
+}
+
+/**
+ * 增加交换槽的引用，fork复制指向此槽的页表项时使用.
+ */ 
+void swap_slot_dup(uint32_t slot) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(slot > 0 && slot < swap_slots && swap_map[slot].count > 0 && swap_map[slot].count < SWAP_COUNT_MAX);
+    swap_map[slot].count++;
+    intr_set_status(old_status);
+}
+
+/**
+ * 释放交换槽的一个引用，最后一个引用释放后此槽空闲.
+ */ 
+void swap_slot_put(uint32_t slot) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(slot > 0 && slot < swap_slots && swap_map[slot].count > 0);
+    if (--swap_map[slot].count == 0) {
+        swap_slot_zram_drop(&swap_map[slot]);
+        ++free_slots;
+    }
+    intr_set_status(old_status);
+}
+
+uint32_t swap_slot_count(uint32_t slot) {
+    ASSERT(slot > 0 && slot < swap_slots);
+    return swap_map[slot].count;
+}
+
+/**
+ * 槽中的数据是否保存在硬盘上.
+ */ 
+int swap_slot_on_disk(uint32_t slot) {
+    ASSERT(slot > 0 && slot < swap_slots);
+    return (swap_map[slot].count > 0 && !swap_map[slot].in_zram);
+}
+
+uint32_t swap_free_slots(void) {
+    return free_slots;
+}
+
+/**
+ * 读取交换槽中的一页到buf，成功返回0.
+ */ 
+int swap_read(uint32_t slot, void* buf) {
+    ASSERT(slot > 0 && slot < swap_slots);
+    struct swap_slot* sslot = &swap_map[slot];
+    if (sslot->in_zram) {
+        return zram_load(sslot->zram_handle, sslot->zram_len, buf);
+    }
+
+    return ata_read(SWAP_START_SECTOR + slot * SECTORS_PER_SLOT, buf, SECTORS_PER_SLOT);
+}
+
+/**
+ * 把buf处的一页写入交换槽: 先尝试压缩到zram，不行再写硬盘，此槽没有硬盘空间时返回-1. 成功返回0. 调用者须持有swap_lock.
+ */ 
+int swap_write(uint32_t slot, const void* buf) {
+    ASSERT(slot > 0 && slot < swap_slots);
+    struct swap_slot* sslot = &swap_map[slot];
+
+    // 重写脏页时原有的数据作废
+    enum intr_status old_status = intr_disable();
+    swap_slot_zram_drop(sslot);
+    intr_set_status(old_status);
+
+    void* handle;
+    uint16_t len;
+    if (zram_store(buf, &handle, &len) == 0) {
+        old_status = intr_disable();
+        sslot->zram_handle = handle;
+        sslot->zram_len = len;
+        sslot->in_zram = 1;
+        intr_set_status(old_status);
+        return 0;
+    }
+
+    if (slot >= disk_slots) {
+        return -1;
+    }
+    return ata_write(SWAP_START_SECTOR + slot * SECTORS_PER_SLOT, buf, SECTORS_PER_SLOT);
+}
@@ -0,0 +1,16 @@
+# ifndef _KERNEL_SWAP_H
+# define _KERNEL_SWAP_H
+
+# include "stdint.h"
+
+void swap_init(void);
+uint32_t swap_slot_alloc(void);
+void swap_slot_dup(uint32_t slot);
+void swap_slot_put(uint32_t slot);
+uint32_t swap_slot_count(uint32_t slot);
+int swap_slot_on_disk(uint32_t slot);
+uint32_t swap_free_slots(void);
+int swap_read(uint32_t slot, void* buf);
+int swap_write(uint32_t slot, const void* buf);
+
+# endif
@@ -7,8 +7,41 @@
 # include "debug.h"
 # include "kernel/print.h"
 # include "process.h"
+# include "thread/sync.h"
+# include "bitmap.h"
+# include "timer.h"
+# include "io.h"
 
-static struct list_elem* thread_tag;
+// 缓存的PCB页个数上限，超出的页直接归还内存池
+# define PCB_CACHE_MAX 16
+
+/**
+ * 一组按优先级划分的就绪队列.
+ */ 
+struct prio_array {
+    // 第i位为1表示优先级为(PRIO_LEVELS - 1 - i)的队列非空，bsf得到的即是最高的非空优先级
+    uint32_t bitmap;
+    struct list queues[PRIO_LEVELS];
+};
+
+// 时间片未用完的任务位于active中，用完的进入expired，active为空时二者交换.
+// 高优先级的任务先运行，低优先级的任务在每一轮中也都能运行到，不会饿死
+static struct prio_array prio_arrays[2];
+static struct prio_array* active_array = &prio_arrays[0];
+static struct prio_array* expired_array = &prio_arrays[1];
+// 没有其它可运行的任务时运行，不在就绪队列中
+static struct task_struct* idle_thread;
+// idle线程停机等待中断的次数
+static uint32_t idle_halts;
+// 上一次任务切换时的TSC
+static uint64_t switch_tsc;
+// 分配pid时使用的锁
+static struct lock pid_lock;
+// 已退出任务的PCB页(连同其内核栈)，新任务优先复用，节点复用general_tag
+static struct list pcb_cache;
+static uint32_t pcb_cache_count;
+// 已退出但可能仍在其内核栈上运行的任务的PCB，切换走之后才能由pcb_reap归还
+static struct list pcb_dead;
 
 /**
  * 任务切换.
@@ -17,10 +50,42 @@ extern void switch_to(struct task_struct* cur, struct task_struct* next);
 
 static void kernel_thread(thread_func* function, void* func_args);
 static void make_main_thread();
+static void pcb_reap(void);
+
+/**
+ * 把任务加入array中其优先级对应的队列，head为1时加到队首. 需要关中断调用.
+ */ 
+static void prio_array_enqueue(struct prio_array* array, struct task_struct* pthread, uint8_t head) {
+    struct list* queue = &array->queues[pthread->priority];
+    if (head) {
+        list_push(queue, &pthread->general_tag);
+    } else {
+        list_append(queue, &pthread->general_tag);
+    }
+    array->bitmap |= (1u << (PRIO_LEVELS - 1 - pthread->priority));
+}
+
+/**
+ * 取出array中优先级最高的任务，array为空时返回NULL. 需要关中断调用.
+ */ 
+static struct task_struct* prio_array_dequeue(struct prio_array* array) {
+    if (array->bitmap == 0) {
+        return NULL;
+    }
+
+    uint32_t prio = PRIO_LEVELS - 1 - bit_scan_forward(array->bitmap);
+    struct list* queue = &array->queues[prio];
+    struct task_struct* pthread = elem2entry(struct task_struct, general_tag, list_pop(queue));
+    if (list_empty(queue)) {
+        array->bitmap &= ~(1u << (PRIO_LEVELS - 1 - prio));
+    }
+    return pthread;
+}
 
 static void kernel_thread(thread_func* function, void* func_args) {
     intr_enable();
     function(func_args);
+    thread_exit();
 }
 
 static void make_main_thread() {
@@ -32,6 +97,41 @@ static void make_main_thread() {
     list_append(&thread_all_list, &main_thread->all_list_tag);
 }
 
+/**
+ * idle线程，没有可运行的任务时停机直到下一个中断，中断唤醒了其它任务就立即让出CPU.
+ */ 
+static void idle(void* arg UNUSED) {
+    while (1) {
+        pcb_reap();
+        intr_disable();
+        if (active_array->bitmap == 0 && expired_array->bitmap == 0) {
+            idle_halts++;
+            // 停机期间只有定时器到期才需要时钟中断
+            timer_tickless_enter(0xffffffff);
+            // sti之后的一条指令执行完才响应中断，在检查与hlt之间到来的中断不会被错过
+            asm volatile ("sti; hlt" : : : "memory");
+            // 被其它中断提前唤醒，补上已过去的嘀嗒
+            intr_disable();
+            timer_tickless_exit();
+            intr_enable();
+        } else {
+            schedule();
+            intr_enable();
+        }
+    }
+}
+
+/**
+ * 创建idle线程，只加入全部线程队列.
+ */ 
+static void make_idle_thread(void) {
+    idle_thread = pcb_alloc();
+    init_thread(idle_thread, "idle", 1);
+    thread_create(idle_thread, idle, NULL);
+
+    list_append(&thread_all_list, &idle_thread->all_list_tag);
+}
+
 /**
  * 获取当前线程PCB地址.
  */ 
@@ -55,11 +155,75 @@ void thread_create(struct task_struct* pthread, thread_func function, void* func
     kthread_stack->ebp = kthread_stack->ebx = kthread_stack->edi = kthread_stack->esi = 0;
 }
 
+/**
+ * 分配pid.
+ */ 
+static pid_t allocate_pid(void) {
+    static pid_t next_pid = 0;
+    lock_acquire(&pid_lock);
+    next_pid++;
+    lock_release(&pid_lock);
+    return next_pid;
+}
+
+/**
+ * 为fork出的子进程分配pid.
+ */ 
+pid_t fork_pid(void) {
+    return allocate_pid();
+}
+
+/**
+ * 为新任务分配PCB页，优先复用已退出任务的PCB，不必经过内存分配器. 内容不保证为0，由调用者初始化.
+ */ 
+struct task_struct* pcb_alloc(void) {
+    pcb_reap();
+
+    enum intr_status old_status = intr_disable();
+    if (!list_empty(&pcb_cache)) {
+        struct task_struct* pthread = elem2entry(struct task_struct, general_tag, list_pop(&pcb_cache));
+        pcb_cache_count--;
+        intr_set_status(old_status);
+        return pthread;
+    }
+    intr_set_status(old_status);
+
+    return get_kernel_pages(1);
+}
+
+/**
+ * 归还PCB页: 缓存未满时留给新任务复用，否则归还内存池. 不能用于正在运行的任务.
+ */ 
+void pcb_free(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+    if (pcb_cache_count < PCB_CACHE_MAX) {
+        list_append(&pcb_cache, &pthread->general_tag);
+        pcb_cache_count++;
+    } else {
+        mfree_page(PF_KERNEL, pthread, 1);
+    }
+    intr_set_status(old_status);
+}
+
+/**
+ * 归还已退出任务的PCB页，由其它任务调用，此时它们已不在PCB页上运行.
+ */ 
+static void pcb_reap(void) {
+    enum intr_status old_status = intr_disable();
+    while (!list_empty(&pcb_dead)) {
+        pcb_free(elem2entry(struct task_struct, general_tag, list_pop(&pcb_dead)));
+    }
+    intr_set_status(old_status);
+}
+
 /**
  * 初始化线程基本信息.
  */ 
 void init_thread(struct task_struct* pthread, char* name, int prio) {
+    ASSERT(prio > 0 && prio < PRIO_LEVELS);
+
     memset(pthread, 0, sizeof(*pthread));
+    pthread->pid = allocate_pid();
     strcpy(pthread->name, name);
 
     if (pthread == main_thread) {
@@ -70,7 +234,7 @@ void init_thread(struct task_struct* pthread, char* name, int prio) {
 
     pthread->priority = prio;
     pthread->ticks = prio;
-    pthread->elaspsed_ticks = 0;
+    pthread->runtime_cycles = 0;
     pthread->pgdir = NULL;
     // PCB所在物理页的顶端地址
     pthread->self_kstack = (uint32_t*) ((uint32_t) pthread + PAGE_SIZE);
@@ -81,19 +245,30 @@ void init_thread(struct task_struct* pthread, char* name, int prio) {
  * 创建线程.
  */ 
 struct task_struct* thread_start(char* name, int prio, thread_func function, void* func_args) {
-    struct task_struct* thread = get_kernel_pages(1);
+    struct task_struct* thread = pcb_alloc();
 
     init_thread(thread, name, prio);
     thread_create(thread, function, func_args);
 
-    ASSERT(!list_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    thread_ready(thread);
 
     ASSERT(!list_find(&thread_all_list, &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag);
     return thread;
 }
 
+/**
+ * 把新建的任务加入就绪队列.
+ */ 
+void thread_ready(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+
+    ASSERT(pthread->status == TASK_READY);
+    prio_array_enqueue(active_array, pthread, 0);
+
+    intr_set_status(old_status);
+}
+
 /**
  * 线程调度.
  */ 
@@ -102,20 +277,38 @@ void schedule() {
 
     struct task_struct* cur_thread = running_thread();
     if (cur_thread->status == TASK_RUNNING) {
-        // 时间片用完，重新加到就绪队列
-        ASSERT(!list_find(&thread_ready_list, &cur_thread->general_tag));
-        list_append(&thread_ready_list, &cur_thread->general_tag);
+        // 时间片用完，等本轮其它任务都运行过之后再运行
+        if (cur_thread != idle_thread) {
+            prio_array_enqueue(expired_array, cur_thread, 0);
+        }
         cur_thread->ticks = cur_thread->priority;
         cur_thread->status = TASK_READY;
     }
-    
-    // 当前没有实现idle线程，所以要保证必须有可调度的线程存在
-    ASSERT(!list_empty(&thread_ready_list));
 
-    thread_tag = NULL;
-    thread_tag = list_pop(&thread_ready_list);
-    struct task_struct* next = elem2entry(struct task_struct, general_tag, thread_tag);
+    struct task_struct* next = prio_array_dequeue(active_array);
+    if (next == NULL) {
+        // 本轮结束，开始新的一轮
+        struct prio_array* array = active_array;
+        active_array = expired_array;
+        expired_array = array;
+        next = prio_array_dequeue(active_array);
+    }
+
+    if (next == NULL) {
+        // 所有任务都已阻塞
+        next = idle_thread;
+    }
+
     next->status = TASK_RUNNING;
+    if (next == cur_thread) {
+        // 只有idle线程可以运行，而它正在运行
+        return;
+    }
+
+    // 当前任务这一次运行的时间
+    uint64_t now = rdtsc();
+    cur_thread->runtime_cycles += now - switch_tsc;
+    switch_tsc = now;
     // 初始化页表
     process_activate(next);
     
@@ -141,14 +334,35 @@ void thread_block(enum task_status status) {
     intr_set_status(old_status);
 }
 
+/**
+ * 结束当前任务: 进程先释放其用户空间，PCB放入待回收队列，然后调度其它任务，不再返回.
+ */ 
+void thread_exit(void) {
+    struct task_struct* cur = running_thread();
+    ASSERT(cur != main_thread);
+
+    if (cur->pgdir != NULL) {
+        process_release(cur);
+    }
+
+    // 当前仍在PCB页上的内核栈运行，不能马上放入缓存或归还内存池，由切换之后的任务经pcb_reap回收
+    intr_disable();
+    list_remove(&cur->all_list_tag);
+    cur->status = TASK_DIED;
+    list_append(&pcb_dead, &cur->general_tag);
+
+    schedule();
+    PANIC("thread_exit: should not be here!");
+}
+
 void thread_unblock(struct task_struct* pthread) {
     enum intr_status old_status = intr_disable();
 
     ASSERT(pthread->status == TASK_BLOCKED || pthread->status == TASK_HANGING || pthread->status == TASK_WAITTING);
 
     if (pthread->status != TASK_READY) {
-        ASSERT(!list_find(&thread_ready_list, &pthread->general_tag));
-        list_push(&thread_ready_list, &pthread->general_tag);
+        // 被唤醒的任务在本轮中优先运行
+        prio_array_enqueue(active_array, pthread, 1);
         pthread->status = TASK_READY;
     }
 
@@ -161,7 +375,36 @@ void thread_unblock(struct task_struct* pthread) {
 void thread_init() {
     put_str("Start to init thread...\n");
     list_init(&thread_all_list);
-    list_init(&thread_ready_list);
+    uint32_t prio;
+    for (prio = 0; prio < PRIO_LEVELS; prio++) {
+        list_init(&prio_arrays[0].queues[prio]);
+        list_init(&prio_arrays[1].queues[prio]);
+    }
+    lock_init(&pid_lock);
+    list_init(&pcb_cache);
+    list_init(&pcb_dead);
+    // main从此时开始计时，否则第一次切换时上电以来的周期都会算在main头上
+    switch_tsc = rdtsc();
     make_main_thread();
+    make_idle_thread();
     put_str("Thread init done.\n");
+}
+
+/**
+ * 除当前任务外是否没有其它可运行的任务，idle线程不算.
+ */ 
+int thread_alone(void) {
+    return (running_thread() != idle_thread && active_array->bitmap == 0 && expired_array->bitmap == 0);
+}
+
+/**
+ * 打印idle线程运行的微秒数(即CPU空闲的时间)以及停机的次数.
+ */ 
+void print_idle_stat(void) {
+    // 微秒数按32位输出，约71分钟回绕
+    put_str("Idle us: ");
+    put_int((uint32_t) tsc_to_us(idle_thread->runtime_cycles));
+    put_str("; halts: ");
+    put_int(idle_halts);
+    put_char('\n');
 }
\ No newline at end of file
@@ -4,13 +4,17 @@
 # include "stdint.h"
 # include "kernel/list.h"
 # include "memory.h"
+# include "vma.h"
 
 /**
  * 自定义通用函数类型.
  */ 
 typedef void thread_func(void*);
+typedef int16_t pid_t;
 
 # define PAGE_SIZE 4096
+// 优先级的级数，每一级对应一个就绪队列
+# define PRIO_LEVELS 32
 
 /**
  * 线程状态.
@@ -71,33 +75,42 @@ struct thread_stack {
 struct task_struct {
     // 内核栈
     uint32_t* self_kstack;
+    pid_t pid;
     enum task_status status;
     char name[16];
+    // 优先级，[0, PRIO_LEVELS)，越大越先运行，同时也是时间片的嘀嗒数
     uint8_t priority;
     // 当前线程可以占用的CPU嘀嗒数
     uint8_t ticks;
-    // 此任务占用的总嘀嗒数
-    uint32_t elaspsed_ticks;
+    // 此任务占用CPU的总时间，TSC周期数，在任务切换时累计
+    uint64_t runtime_cycles;
     // 可执行队列节点
     struct list_elem general_tag;
     // 所有不可运行线程队列节点
     struct list_elem all_list_tag;
     uint32_t* pgdir;
-    struct virtual_addr userprog_addr;
+    // 用户进程的虚拟地址空间
+    struct vm_space vm_space;
     uint32_t stack_magic;
 };
 
 struct task_struct* main_thread;
-struct list thread_ready_list;
 struct list thread_all_list;
 
 struct task_struct* running_thread();
 void thread_create(struct task_struct* pthread, thread_func function, void* func_args);
 void init_thread(struct task_struct* pthread, char* name, int prio);
+struct task_struct* pcb_alloc(void);
+void pcb_free(struct task_struct* pthread);
 struct task_struct* thread_start(char* name, int prio, thread_func function, void* func_args);
 void schedule();
 void thread_init();
 void thread_block(enum task_status status);
 void thread_unblock(struct task_struct* pthread);
+void thread_ready(struct task_struct* pthread);
+int thread_alone(void);
+void print_idle_stat(void);
+void thread_exit(void);
+pid_t fork_pid(void);
 
 # endif
\ No newline at end of file
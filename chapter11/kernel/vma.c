@@ -0,0 +1,262 @@
+# include "vma.h"
+# include "memory.h"
+# include "global.h"
+# include "debug.h"
+
+# define node2vma(n) (elem2entry(struct vm_area, node, n))
+
+static int vma_less(struct avl_node* a, struct avl_node* b) {
+    return node2vma(a)->start < node2vma(b)->start;
+}
+
+/**
+ * max_gap = max(自身的gap, 左右子树的max_gap).
+ */ 
+static void vma_augment(struct avl_node* node) {
+    struct vm_area* vma = node2vma(node);
+    uint32_t max_gap = vma->gap;
+
+    if (node->left != NULL && node2vma(node->left)->max_gap > max_gap) {
+        max_gap = node2vma(node->left)->max_gap;
+    }
+    if (node->right != NULL && node2vma(node->right)->max_gap > max_gap) {
+        max_gap = node2vma(node->right)->max_gap;
+    }
+
+    vma->max_gap = max_gap;
+}
+
+static struct vm_area* vma_first(struct vm_space* vs) {
+    struct avl_node* node = avl_first(&vs->tree);
+    return node == NULL ? NULL : node2vma(node);
+}
+
+static struct vm_area* vma_next(struct vm_area* vma) {
+    struct avl_node* node = avl_next(&vma->node);
+    return node == NULL ? NULL : node2vma(node);
+}
+
+static struct vm_area* vma_prev(struct vm_area* vma) {
+    struct avl_node* node = avl_prev(&vma->node);
+    return node == NULL ? NULL : node2vma(node);
+}
+
+/**
+ * 起始地址不大于vaddr的最后一个区域，没有时返回NULL.
+ */ 
+static struct vm_area* vma_floor(struct vm_space* vs, uint32_t vaddr) {
+    struct avl_node* node = vs->tree.root;
+    struct vm_area* result = NULL;
+
+    while (node != NULL) {
+        struct vm_area* vma = node2vma(node);
+        if (vma->start <= vaddr) {
+            result = vma;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * 重新计算vma的gap(前一个区域的结束地址变化后调用)，vma可为NULL.
+ */ 
+static void vma_gap_update(struct vm_space* vs, struct vm_area* vma) {
+    if (vma == NULL) {
+        return;
+    }
+
+    struct vm_area* prev = vma_prev(vma);
+    vma->gap = vma->start - (prev == NULL ? vs->vaddr_start : prev->end);
+    avl_augment_update(&vs->tree, &vma->node);
+}
+
+static int vma_insert(struct vm_space* vs, uint32_t start, uint32_t end, uint32_t flags) {
+    struct vm_area* vma = kmalloc(sizeof(struct vm_area));
+    if (vma == NULL) {
+        return -1;
+    }
+
+    struct vm_area* prev = vma_floor(vs, start);
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->gap = start - (prev == NULL ? vs->vaddr_start : prev->end);
+    avl_insert(&vs->tree, &vma->node);
+    vs->vma_count++;
+
+    vma_gap_update(vs, vma_next(vma));
+    return 0;
+}
+
+static void vma_delete(struct vm_space* vs, struct vm_area* vma) {
+    struct vm_area* next = vma_next(vma);
+
+    avl_remove(&vs->tree, &vma->node);
+    vs->vma_count--;
+    kfree(vma);
+
+    vma_gap_update(vs, next);
+}
+
+void vm_space_init(struct vm_space* vs, uint32_t vaddr_start, uint32_t mmap_end, uint32_t vaddr_end) {
+    avl_init(&vs->tree, vma_less, vma_augment);
+    vs->vaddr_start = vaddr_start;
+    vs->mmap_end = mmap_end;
+    vs->vaddr_end = vaddr_end;
+    vs->vma_count = 0;
+}
+
+/**
+ * 包含vaddr的区域，没有时返回NULL.
+ */ 
+struct vm_area* vma_find(struct vm_space* vs, uint32_t vaddr) {
+    struct vm_area* vma = vma_floor(vs, vaddr);
+    return (vma != NULL && vaddr < vma->end) ? vma : NULL;
+}
+
+/**
+ * 查找地址最低的长度不小于len的空闲区间，返回其起始地址，失败返回0.
+ */ 
+uint32_t vma_get_unmapped(struct vm_space* vs, uint32_t len) {
+    struct avl_node* node = vs->tree.root;
+    uint32_t start = 0;
+
+    // 借助max_gap只走一条从根到叶子的路径: 左子树中有足够大的空闲区间时总是优先选择左边
+    while (node != NULL) {
+        struct vm_area* vma = node2vma(node);
+        if (node->left != NULL && node2vma(node->left)->max_gap >= len) {
+            node = node->left;
+        } else if (vma->gap >= len) {
+            start = vma->start - vma->gap;
+            break;
+        } else if (node->right != NULL && node2vma(node->right)->max_gap >= len) {
+            node = node->right;
+        } else {
+            break;
+        }
+    }
+
+    if (start == 0) {
+        // 最后一个区域之后的空闲区间
+        struct avl_node* last = avl_last(&vs->tree);
+        start = (last == NULL ? vs->vaddr_start : node2vma(last)->end);
+    }
+
+    // 更高的空闲区间只会越过mmap_end更多
+    if (start < vs->vaddr_start || start + len > vs->mmap_end || start + len < start) {
+        return 0;
+    }
+    return start;
+}
+
+/**
+ * 添加区域[start, end)，与属性相同的相邻区域合并. 与已有区域重叠或内存不足时返回-1.
+ */ 
+int vma_map(struct vm_space* vs, uint32_t start, uint32_t end, uint32_t flags) {
+    ASSERT(start < end && !(start & 0xfff) && !(end & 0xfff));
+    if (start < vs->vaddr_start || end > vs->vaddr_end) {
+        return -1;
+    }
+
+    struct vm_area* prev = vma_floor(vs, start);
+    struct vm_area* next = (prev == NULL ? vma_first(vs) : vma_next(prev));
+    if ((prev != NULL && prev->end > start) || (next != NULL && next->start < end)) {
+        return -1;
+    }
+
+    int merge_prev = (prev != NULL && prev->end == start && prev->flags == flags);
+    int merge_next = (next != NULL && next->start == end && next->flags == flags);
+
+    if (merge_prev && merge_next) {
+        prev->end = next->end;
+        vma_delete(vs, next);
+    } else if (merge_prev) {
+        prev->end = end;
+        vma_gap_update(vs, next);
+    } else if (merge_next) {
+        next->start = start;
+        vma_gap_update(vs, next);
+    } else {
+        return vma_insert(vs, start, end, flags);
+    }
+
+    return 0;
+}
+
+/**
+ * 移除[start, end)内的所有映射，部分覆盖的区域被截短或一分为二. 拆分区域时内存不足返回-1，此时不做任何修改.
+ */ 
+int vma_unmap(struct vm_space* vs, uint32_t start, uint32_t end) {
+    ASSERT(start < end);
+
+    struct vm_area* vma = vma_floor(vs, start);
+    if (vma == NULL || vma->end <= start) {
+        vma = (vma == NULL ? vma_first(vs) : vma_next(vma));
+    }
+
+    if (vma != NULL && vma->start < start && vma->end > end) {
+        // 从中间挖去一段，后一半成为新的区域
+        uint32_t old_end = vma->end;
+        vma->end = start;
+        if (vma_insert(vs, end, old_end, vma->flags) == -1) {
+            vma->end = old_end;
+            return -1;
+        }
+        return 0;
+    }
+
+    while (vma != NULL && vma->start < end) {
+        struct vm_area* next = vma_next(vma);
+
+        if (vma->start >= start && vma->end <= end) {
+            vma_delete(vs, vma);
+        } else if (vma->start < start) {
+            // 截去尾部
+            vma->end = start;
+            vma_gap_update(vs, next);
+        } else {
+            // 截去头部
+            vma->start = end;
+            vma_gap_update(vs, vma);
+        }
+
+        vma = next;
+    }
+
+    return 0;
+}
+
+/**
+ * 复制src中的所有区域到空的dst中，内存不足时返回-1，dst保持为空.
+ */ 
+int vm_space_copy(struct vm_space* dst, struct vm_space* src) {
+    vm_space_init(dst, src->vaddr_start, src->mmap_end, src->vaddr_end);
+
+    struct avl_node* node = avl_first(&src->tree);
+    while (node != NULL) {
+        struct vm_area* vma = node2vma(node);
+        if (vma_insert(dst, vma->start, vma->end, vma->flags) == -1) {
+            vm_space_destroy(dst);
+            return -1;
+        }
+        node = avl_next(node);
+    }
+
+    return 0;
+}
+
+/**
+ * 释放地址空间中所有的区域.
+ */ 
+void vm_space_destroy(struct vm_space* vs) {
+    struct avl_node* node;
+    while ((node = vs->tree.root) != NULL) {
+        avl_remove(&vs->tree, node);
+        kfree(node2vma(node));
+    }
+    vs->vma_count = 0;
+}
@@ -0,0 +1,46 @@
+# ifndef _KERNEL_VMA_H
+# define _KERNEL_VMA_H
+
+# include "stdint.h"
+# include "kernel/avl.h"
+
+// 可写的匿名内存
+# define VM_WRITE 1
+// 用户栈，缺页时可以向下增长
+# define VM_STACK 2
+
+/**
+ * 虚拟内存区域，[start, end)按页对齐，属性相同的相邻区域会被合并.
+ */ 
+struct vm_area {
+    struct avl_node node;
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;
+    // 此区域与前一个区域(或地址空间起始处)之间空闲区间的长度
+    uint32_t gap;
+    // 以此区域为根的子树中最大的gap，用于O(log n)地查找空闲区间
+    uint32_t max_gap;
+};
+
+/**
+ * 用户进程的虚拟地址空间，区域按起始地址组织成AVL树.
+ */ 
+struct vm_space {
+    struct avl_tree tree;
+    // 区域可以位于[vaddr_start, vaddr_end)中，vma_get_unmapped只在[vaddr_start, mmap_end)中分配
+    uint32_t vaddr_start;
+    uint32_t mmap_end;
+    uint32_t vaddr_end;
+    uint32_t vma_count;
+};
+
+void vm_space_init(struct vm_space* vs, uint32_t vaddr_start, uint32_t mmap_end, uint32_t vaddr_end);
+struct vm_area* vma_find(struct vm_space* vs, uint32_t vaddr);
+uint32_t vma_get_unmapped(struct vm_space* vs, uint32_t len);
+int vma_map(struct vm_space* vs, uint32_t start, uint32_t end, uint32_t flags);
+int vma_unmap(struct vm_space* vs, uint32_t start, uint32_t end);
+int vm_space_copy(struct vm_space* dst, struct vm_space* src);
+void vm_space_destroy(struct vm_space* vs);
+
+# endif
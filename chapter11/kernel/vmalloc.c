@@ -0,0 +1,262 @@
+# include "vmalloc.h"
+# include "memory.h"
+# include "global.h"
+# include "debug.h"
+# include "interrupt.h"
+# include "kernel/avl.h"
+# include "kernel/list.h"
+
+# define PAGE_SIZE 4096
+
+# define addr2extent(n) (elem2entry(struct vm_extent, addr_node, n))
+# define size2extent(n) (elem2entry(struct vm_extent, size_node, n))
+
+/**
+ * 一段空闲的内核虚拟地址，同时挂在按地址和按大小排序的两棵树上.
+ */ 
+struct vm_extent {
+    struct avl_node addr_node;
+    struct avl_node size_node;
+    uint32_t start;
+    uint32_t pg_cnt;
+    // 空闲节点链表
+    struct list_elem free_tag;
+};
+
+// 按起始地址排序，用于释放时查找相邻的空闲段
+static struct avl_tree addr_tree;
+// 按(页数, 起始地址)排序，用于最佳适配
+static struct avl_tree size_tree;
+// 未使用的节点，不够时整页补充
+static struct list extent_free_list;
+// 第一个空闲段的节点，此时还无法分配内存
+static struct vm_extent first_extent;
+static uint32_t free_pages;
+
+static int addr_less(struct avl_node* a, struct avl_node* b) {
+    return addr2extent(a)->start < addr2extent(b)->start;
+}
+
+static int size_less(struct avl_node* a, struct avl_node* b) {
+    struct vm_extent* ea = size2extent(a);
+    struct vm_extent* eb = size2extent(b);
+    return ea->pg_cnt < eb->pg_cnt || (ea->pg_cnt == eb->pg_cnt && ea->start < eb->start);
+}
+
+/**
+ * 取一个空闲节点，没有时返回NULL.
+ */ 
+static struct vm_extent* extent_get(void) {
+    if (list_empty(&extent_free_list)) {
+        return NULL;
+    }
+    return elem2entry(struct vm_extent, free_tag, list_pop(&extent_free_list));
+}
+
+static void extent_put(struct vm_extent* extent) {
+    list_push(&extent_free_list, &extent->free_tag);
+}
+
+/**
+ * 保证至少有一个空闲节点. 新的节点页通过malloc_page申请，分配虚拟地址只会缩小已有的空闲段，不需要节点，所以不会递归.
+ */ 
+static void extent_refill(void) {
+    if (!list_empty(&extent_free_list)) {
+        return;
+    }
+
+    struct vm_extent* extents = malloc_page(PF_KERNEL, 1);
+    if (extents == NULL) {
+        return;
+    }
+
+    uint32_t idx;
+    for (idx = 0; idx < PAGE_SIZE / sizeof(struct vm_extent); idx++) {
+        extent_put(&extents[idx]);
+    }
+}
+
+static void extent_insert(struct vm_extent* extent) {
+    avl_insert(&addr_tree, &extent->addr_node);
+    avl_insert(&size_tree, &extent->size_node);
+}
+
+static void extent_delete(struct vm_extent* extent) {
+    avl_remove(&addr_tree, &extent->addr_node);
+    avl_remove(&size_tree, &extent->size_node);
+    extent_put(extent);
+}
+
+/**
+ * 修改空闲段的起始地址和页数. 调用者保证其在地址树中的相对顺序不变，只需在大小树中重新插入.
+ */ 
+static void extent_resize(struct vm_extent* extent, uint32_t start, uint32_t pg_cnt) {
+    avl_remove(&size_tree, &extent->size_node);
+    extent->start = start;
+    extent->pg_cnt = pg_cnt;
+    avl_insert(&size_tree, &extent->size_node);
+}
+
+/**
+ * 起始地址不大于vaddr的最后一个空闲段，没有时返回NULL.
+ */ 
+static struct vm_extent* extent_floor(uint32_t vaddr) {
+    struct avl_node* node = addr_tree.root;
+    struct vm_extent* result = NULL;
+
+    while (node != NULL) {
+        struct vm_extent* extent = addr2extent(node);
+        if (extent->start <= vaddr) {
+            result = extent;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * 初始化内核虚拟地址分配器，[vaddr_start, vaddr_start + pg_cnt * 4KB)全部空闲.
+ */ 
+void kvaddr_init(uint32_t vaddr_start, uint32_t pg_cnt) {
+    avl_init(&addr_tree, addr_less, NULL);
+    avl_init(&size_tree, size_less, NULL);
+    list_init(&extent_free_list);
+
+    first_extent.start = vaddr_start;
+    first_extent.pg_cnt = pg_cnt;
+    extent_insert(&first_extent);
+    free_pages = pg_cnt;
+}
+
+/**
+ * 分配pg_cnt个连续的虚拟页: 在大小树中找页数不小于pg_cnt的最小空闲段(最佳适配)，从其头部切下，失败返回0.
+ */ 
+uint32_t kvaddr_alloc(uint32_t pg_cnt) {
+    ASSERT(pg_cnt > 0);
+
+    enum intr_status old_status = intr_disable();
+
+    struct avl_node* node = size_tree.root;
+    struct vm_extent* best = NULL;
+    while (node != NULL) {
+        struct vm_extent* extent = size2extent(node);
+        if (extent->pg_cnt >= pg_cnt) {
+            best = extent;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    uint32_t vaddr = 0;
+    if (best != NULL) {
+        vaddr = best->start;
+        if (best->pg_cnt == pg_cnt) {
+            extent_delete(best);
+        } else {
+            extent_resize(best, best->start + pg_cnt * PAGE_SIZE, best->pg_cnt - pg_cnt);
+        }
+        free_pages -= pg_cnt;
+    }
+
+    intr_set_status(old_status);
+    return vaddr;
+}
+
+/**
+ * 占用指定的[vaddr, vaddr + pg_cnt * 4KB)，其必须完全处于某个空闲段中，否则返回-1.
+ */ 
+int kvaddr_reserve(uint32_t vaddr, uint32_t pg_cnt) {
+    ASSERT(pg_cnt > 0 && !(vaddr & 0xfff));
+
+    enum intr_status old_status = intr_disable();
+    // 从中间切开时需要一个新节点
+    extent_refill();
+
+    uint32_t end = vaddr + pg_cnt * PAGE_SIZE;
+    struct vm_extent* extent = extent_floor(vaddr);
+    if (extent == NULL || extent->start + extent->pg_cnt * PAGE_SIZE < end) {
+        intr_set_status(old_status);
+        return -1;
+    }
+
+    uint32_t extent_end = extent->start + extent->pg_cnt * PAGE_SIZE;
+    if (extent->start == vaddr && extent_end == end) {
+        extent_delete(extent);
+    } else if (extent->start == vaddr) {
+        extent_resize(extent, end, (extent_end - end) / PAGE_SIZE);
+    } else if (extent_end == end) {
+        extent_resize(extent, extent->start, (vaddr - extent->start) / PAGE_SIZE);
+    } else {
+        struct vm_extent* tail = extent_get();
+        if (tail == NULL) {
+            intr_set_status(old_status);
+            return -1;
+        }
+
+        extent_resize(extent, extent->start, (vaddr - extent->start) / PAGE_SIZE);
+        tail->start = end;
+        tail->pg_cnt = (extent_end - end) / PAGE_SIZE;
+        extent_insert(tail);
+    }
+    free_pages -= pg_cnt;
+
+    intr_set_status(old_status);
+    return 0;
+}
+
+/**
+ * 归还[vaddr, vaddr + pg_cnt * 4KB)，与前后相邻的空闲段合并.
+ */ 
+void kvaddr_free(uint32_t vaddr, uint32_t pg_cnt) {
+    ASSERT(pg_cnt > 0 && !(vaddr & 0xfff));
+
+    enum intr_status old_status = intr_disable();
+    // 不与任何空闲段相邻时需要一个新节点，补充节点可能改变树，所以要先于查找进行
+    extent_refill();
+
+    uint32_t end = vaddr + pg_cnt * PAGE_SIZE;
+    struct vm_extent* prev = extent_floor(vaddr);
+    struct avl_node* next_node = (prev == NULL ? avl_first(&addr_tree) : avl_next(&prev->addr_node));
+    struct vm_extent* next = (next_node == NULL ? NULL : addr2extent(next_node));
+
+    ASSERT(prev == NULL || prev->start + prev->pg_cnt * PAGE_SIZE <= vaddr);
+    ASSERT(next == NULL || next->start >= end);
+
+    int merge_prev = (prev != NULL && prev->start + prev->pg_cnt * PAGE_SIZE == vaddr);
+    int merge_next = (next != NULL && next->start == end);
+
+    if (merge_prev && merge_next) {
+        uint32_t next_cnt = next->pg_cnt;
+        extent_delete(next);
+        extent_resize(prev, prev->start, prev->pg_cnt + pg_cnt + next_cnt);
+    } else if (merge_prev) {
+        extent_resize(prev, prev->start, prev->pg_cnt + pg_cnt);
+    } else if (merge_next) {
+        extent_resize(next, vaddr, next->pg_cnt + pg_cnt);
+    } else {
+        struct vm_extent* extent = extent_get();
+        if (extent == NULL) {
+            // 连一页节点都申请不到，只能丢弃这段虚拟地址
+            intr_set_status(old_status);
+            return;
+        }
+
+        extent->start = vaddr;
+        extent->pg_cnt = pg_cnt;
+        extent_insert(extent);
+    }
+    free_pages += pg_cnt;
+
+    intr_set_status(old_status);
+}
+
+/**
+ * 剩余的内核虚拟页数.
+ */ 
+uint32_t kvaddr_free_pages(void) {
+    return free_pages;
+}
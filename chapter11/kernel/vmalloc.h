@@ -0,0 +1,12 @@
+# ifndef _KERNEL_VMALLOC_H
+# define _KERNEL_VMALLOC_H
+
+# include "stdint.h"
+
+void kvaddr_init(uint32_t vaddr_start, uint32_t pg_cnt);
+uint32_t kvaddr_alloc(uint32_t pg_cnt);
+int kvaddr_reserve(uint32_t vaddr, uint32_t pg_cnt);
+void kvaddr_free(uint32_t vaddr, uint32_t pg_cnt);
+uint32_t kvaddr_free_pages(void);
+
+# endif
@@ -0,0 +1,385 @@
+# include "zram.h"
+# include "memory.h"
+# include "global.h"
+# include "string.h"
+# include "debug.h"
+# include "interrupt.h"
+# include "kernel/list.h"
+# include "kernel/print.h"
+
+# define PAGE_SIZE 4096
+
+// 最短的匹配长度
+# define LZ_MIN_MATCH 4
+# define LZ_HASH_BITS 10
+// token中字面量长度和匹配长度各占4位，15表示其后还有扩展字节
+# define LZ_LEN_MASK 15
+
+// 压缩后的大小按64字节分级存放，超过3KB的页不值得压缩
+# define ZRAM_CLASS_STEP 64
+# define ZRAM_MAX_STORE 3072
+# define ZRAM_CLASS_CNT (ZRAM_MAX_STORE / ZRAM_CLASS_STEP)
+
+/**
+ * 存放压缩数据的页的头部，其后是同一规格的若干个块.
+ */ 
+struct zram_page {
+    uint32_t class_idx;
+    // 已使用的块数
+    uint32_t used;
+};
+
+/**
+ * 同一规格的块，空闲块的起始处作为空闲链表的节点.
+ */ 
+struct zram_class {
+    uint32_t block_size;
+    uint32_t blocks_per_page;
+    struct list free_list;
+    uint32_t free_cnt;
+};
+
+static struct zram_class zram_classes[ZRAM_CLASS_CNT];
+// zram最多占用的物理页数及当前占用数
+static uint32_t zram_max_pages;
+static uint32_t zram_pages;
+
+// 统计: 存放的页数(其中全0的页不占空间)、压缩后的总字节数、因压缩效果差或空间不足被拒绝的页数
+static uint32_t stored_pages;
+static uint32_t zero_pages;
+static uint32_t compressed_bytes;
+static uint32_t rejected_pages;
+
+// 压缩只在换出时进行，调用者持有swap_lock，哈希表和输出缓冲区不会被并发使用
+static uint16_t lz_hash_table[1 << LZ_HASH_BITS];
+static uint8_t compress_buf[ZRAM_MAX_STORE];
+
+/**
+ * 按小端读取任意地址处的4个字节.
+ */ 
+static uint32_t lz_read32(const uint8_t* p) {
+    return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24));
+}
+
+static uint32_t lz_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * 写入长度的扩展字节: 逐个为255，直到最后一个小于255的字节.
+ */ 
+static void lz_len_put(uint8_t* dst, uint32_t* op, uint32_t len) {
+    while (len >= 255) {
+        dst[(*op)++] = 255;
+        len -= 255;
+    }
+    dst[(*op)++] = len;
+}
+
+/**
+ * 输出一个序列: token | 字面量长度扩展 | 字面量 | 匹配偏移(2字节，小端) | 匹配长度扩展. match_len为0表示最后一个序列，
+ * 只有字面量. 空间不足时返回0.
+ */ 
+static int lz_sequence_put(uint8_t* dst, uint32_t dst_cap, uint32_t* op, const uint8_t* literal, uint32_t literal_len,
+                           uint32_t offset, uint32_t match_len) {
+    uint32_t match_code = (match_len == 0 ? 0 : match_len - LZ_MIN_MATCH);
+    // 最坏情况下需要的空间
+    uint32_t need = 1 + (literal_len / 255 + 1) + literal_len + 2 + (match_code / 255 + 1);
+    if (*op + need > dst_cap) {
+        return 0;
+    }
+
+    uint8_t* token = &dst[(*op)++];
+    *token = (((literal_len < LZ_LEN_MASK ? literal_len : LZ_LEN_MASK) << 4) | (match_code < LZ_LEN_MASK ? match_code : LZ_LEN_MASK));
+    if (literal_len >= LZ_LEN_MASK) {
+        lz_len_put(dst, op, literal_len - LZ_LEN_MASK);
+    }
+
+    uint32_t i;
+    for (i = 0; i < literal_len; i++) {
+        dst[(*op)++] = literal[i];
+    }
+
+    if (match_len != 0) {
+        dst[(*op)++] = offset & 0xff;
+        dst[(*op)++] = offset >> 8;
+        if (match_code >= LZ_LEN_MASK) {
+            lz_len_put(dst, op, match_code - LZ_LEN_MASK);
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * LZ77压缩(格式与LZ4的块格式类似): 用哈希表记录每个4字节序列最近出现的位置，找到相同的序列后尽量向后延长匹配.
+ * 返回压缩后的长度，超过dst_cap时返回0.
+ */ 
+static uint32_t lz_compress(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_cap) {
+    uint32_t ip = 0, anchor = 0, op = 0;
+    // 表中保存位置加1，0表示没有
+    memset(lz_hash_table, 0, sizeof(lz_hash_table));
+
+    while (ip + LZ_MIN_MATCH <= src_len) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t hash = lz_hash(seq);
+        uint32_t candidate = lz_hash_table[hash];
+        lz_hash_table[hash] = ip + 1;
+
+        if (candidate == 0 || lz_read32(src + candidate - 1) != seq) {
+            ++ip;
+            continue;
+        }
+        --candidate;
+
+        // 匹配可以与当前位置重叠，解压时逐字节复制即可
+        uint32_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < src_len && src[candidate + match_len] == src[ip + match_len]) {
+            ++match_len;
+        }
+
+        if (!lz_sequence_put(dst, dst_cap, &op, src + anchor, ip - anchor, ip - candidate, match_len)) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    if (!lz_sequence_put(dst, dst_cap, &op, src + anchor, src_len - anchor, 0, 0)) {
+        return 0;
+    }
+    return op;
+}
+
+/**
+ * 读取长度的扩展字节并累加到len上，数据不完整时返回-1.
+ */ 
+static int lz_len_get(const uint8_t* src, uint32_t src_len, uint32_t* ip, uint32_t* len) {
+    uint8_t byte;
+    do {
+        if (*ip >= src_len) {
+            return -1;
+        }
+        byte = src[(*ip)++];
+        *len += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+/**
+ * 解压到dst，解压后的长度必须恰好为dst_len，数据损坏时返回-1.
+ */ 
+static int lz_decompress(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_len) {
+    uint32_t ip = 0, op = 0;
+
+    while (ip < src_len) {
+        uint8_t token = src[ip++];
+
+        uint32_t literal_len = (token >> 4);
+        if (literal_len == LZ_LEN_MASK && lz_len_get(src, src_len, &ip, &literal_len) == -1) {
+            return -1;
+        }
+        if (ip + literal_len > src_len || op + literal_len > dst_len) {
+            return -1;
+        }
+        while (literal_len-- > 0) {
+            dst[op++] = src[ip++];
+        }
+
+        // 最后一个序列没有匹配部分
+        if (ip == src_len) {
+            break;
+        }
+
+        if (ip + 2 > src_len) {
+            return -1;
+        }
+        uint32_t offset = (src[ip] | (src[ip + 1] << 8));
+        ip += 2;
+
+        uint32_t match_len = (token & LZ_LEN_MASK);
+        if (match_len == LZ_LEN_MASK && lz_len_get(src, src_len, &ip, &match_len) == -1) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + match_len > dst_len) {
+            return -1;
+        }
+
+        while (match_len-- > 0) {
+            dst[op] = dst[op - offset];
+            ++op;
+        }
+    }
+
+    return (op == dst_len ? 0 : -1);
+}
+
+/**
+ * 初始化zram，最多占用max_pages个物理页存放压缩数据.
+ */ 
+void zram_init(uint32_t max_pages) {
+    uint32_t idx;
+    for (idx = 0; idx < ZRAM_CLASS_CNT; idx++) {
+        zram_classes[idx].block_size = (idx + 1) * ZRAM_CLASS_STEP;
+        zram_classes[idx].blocks_per_page = (PAGE_SIZE - sizeof(struct zram_page)) / zram_classes[idx].block_size;
+        list_init(&zram_classes[idx].free_list);
+        zram_classes[idx].free_cnt = 0;
+    }
+
+    zram_max_pages = max_pages;
+    zram_pages = stored_pages = zero_pages = compressed_bytes = rejected_pages = 0;
+}
+
+static struct zram_page* block2zpage(void* block) {
+    return (struct zram_page*) ((uint32_t) block & 0xfffff000);
+}
+
+static void* zpage2block(struct zram_page* zpage, uint32_t idx) {
+    return (void*) ((uint32_t) zpage + sizeof(struct zram_page) + idx * zram_classes[zpage->class_idx].block_size);
+}
+
+/**
+ * 分配一个第class_idx级的块，没有空闲块时新申请一页. 换出时调用，不能再引起回收，所以直接从内存池分配，
+ * 但不动用min水位之下的保留页，分配不到时由调用者改写磁盘.
+ */ 
+static void* zram_block_alloc(uint32_t class_idx) {
+    struct zram_class* zclass = &zram_classes[class_idx];
+    enum intr_status old_status = intr_disable();
+
+    if (list_empty(&zclass->free_list)) {
+        uint32_t pg_phy_addr = (zram_pages < zram_max_pages ? (uint32_t) alloc_phy_pages(PF_KERNEL | PF_NORESERVE, 0) : 0);
+        if (pg_phy_addr == 0) {
+            intr_set_status(old_status);
+            return NULL;
+        }
+
+        struct zram_page* zpage = phy2virt(pg_phy_addr);
+        zpage->class_idx = class_idx;
+        zpage->used = 0;
+
+        uint32_t idx;
+        for (idx = 0; idx < zclass->blocks_per_page; idx++) {
+            list_append(&zclass->free_list, zpage2block(zpage, idx));
+        }
+        zclass->free_cnt += zclass->blocks_per_page;
+        ++zram_pages;
+    }
+
+    void* block = list_pop(&zclass->free_list);
+    zclass->free_cnt--;
+    block2zpage(block)->used++;
+
+    intr_set_status(old_status);
+    return block;
+}
+
+/**
+ * 释放块，页中的块全部空闲且此规格还有其它空闲块时归还此页.
+ */ 
+static void zram_block_free(void* block) {
+    enum intr_status old_status = intr_disable();
+
+    struct zram_page* zpage = block2zpage(block);
+    struct zram_class* zclass = &zram_classes[zpage->class_idx];
+    list_push(&zclass->free_list, block);
+    zclass->free_cnt++;
+
+    if (--zpage->used == 0 && zclass->free_cnt > zclass->blocks_per_page) {
+        uint32_t idx;
+        for (idx = 0; idx < zclass->blocks_per_page; idx++) {
+            list_remove(zpage2block(zpage, idx));
+        }
+        zclass->free_cnt -= zclass->blocks_per_page;
+        free_phy_pages(addr_v2p((uint32_t) zpage), 0);
+        --zram_pages;
+    }
+
+    intr_set_status(old_status);
+}
+
+/**
+ * 压缩保存一页，成功返回0并通过handle和len返回存放的位置和压缩后的长度. 全0的页不占空间，len为0.
+ * 压缩后仍大于3KB或没有空间时返回-1. 调用者须持有swap_lock.
+ */ 
+int zram_store(const void* page, void** handle, uint16_t* len) {
+    const uint32_t* words = page;
+    uint32_t idx = 0;
+    while (idx < PAGE_SIZE / 4 && words[idx] == 0) {
+        ++idx;
+    }
+
+    void* block = NULL;
+    uint32_t compressed_len = 0;
+    if (idx < PAGE_SIZE / 4) {
+        compressed_len = lz_compress(page, PAGE_SIZE, compress_buf, ZRAM_MAX_STORE);
+        block = (compressed_len == 0 ? NULL : zram_block_alloc((compressed_len - 1) / ZRAM_CLASS_STEP));
+        if (block == NULL) {
+            ++rejected_pages;
+            return -1;
+        }
+        memcpy(block, compress_buf, compressed_len);
+    }
+
+    // 统计值也会在关中断时被zram_free修改
+    enum intr_status old_status = intr_disable();
+    ++stored_pages;
+    if (compressed_len == 0) {
+        ++zero_pages;
+    }
+    compressed_bytes += compressed_len;
+    intr_set_status(old_status);
+
+    *handle = block;
+    *len = compressed_len;
+    return 0;
+}
+
+/**
+ * 把zram_store保存的页解压到page，数据损坏时返回-1.
+ */ 
+int zram_load(void* handle, uint16_t len, void* page) {
+    if (len == 0) {
+        memset(page, 0, PAGE_SIZE);
+        return 0;
+    }
+
+    return lz_decompress(handle, len, page, PAGE_SIZE);
+}
+
+/**
+ * 丢弃zram_store保存的页.
+ */ 
+void zram_free(void* handle, uint16_t len) {
+    enum intr_status old_status = intr_disable();
+
+    --stored_pages;
+    if (len == 0) {
+        --zero_pages;
+    } else {
+        compressed_bytes -= len;
+        zram_block_free(handle);
+    }
+
+    intr_set_status(old_status);
+}
+
+/**
+ * 打印zram的使用情况，压缩率为存放的页数与实际占用页数之比(乘以100).
+ */ 
+void print_zram_stat(void) {
+    put_str("zram stored pages: ");
+    put_int(stored_pages);
+    put_str("; zero pages: ");
+    put_int(zero_pages);
+    put_str("; compressed bytes: ");
+    put_int(compressed_bytes);
+    put_str("; used pages: ");
+    put_int(zram_pages);
+    put_str("; rejected: ");
+    put_int(rejected_pages);
+    put_str("\nzram ratio x100: ");
+    put_int(zram_pages == 0 ? 0 : stored_pages * 100 / zram_pages);
+    put_char('\n');
+}
@@ -0,0 +1,12 @@
+# ifndef _KERNEL_ZRAM_H
+# define _KERNEL_ZRAM_H
+
+# include "stdint.h"
+
+void zram_init(uint32_t max_pages);
+int zram_store(const void* page, void** handle, uint16_t* len);
+int zram_load(void* handle, uint16_t len, void* page);
+void zram_free(void* handle, uint16_t len);
+void print_zram_stat(void);
+
+# endif
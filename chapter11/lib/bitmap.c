@@ -14,7 +14,7 @@ void bitmap_init(struct bitmap* btmap) {
  */
 int bitmap_scan_test(struct bitmap* btmap, uint32_t index) {
     uint32_t byte_index = (index / 8);
-    uint32_t bit_odd = byte_index % 8;
+    uint32_t bit_odd = index % 8;
 
     return (btmap->bits[byte_index] & (BITMAP_MASK << bit_odd));
 }
@@ -26,11 +26,10 @@ int bitmap_scan(struct bitmap* btmap, uint32_t cnt) {
     uint32_t idx_byte = 0;
 
     // 以字节为单位进行查找
-    while ((0xff == btmap->bits[idx_byte]) && (idx_byte < btmap->btmp_bytes_len)) {
+    while ((idx_byte < btmap->btmp_bytes_len) && (0xff == btmap->bits[idx_byte])) {
         ++idx_byte;
     }
 
-    ASSERT(idx_byte < btmap->btmp_bytes_len);
     // 没有找到
     if (idx_byte == btmap->btmp_bytes_len) {
         return -1;
@@ -54,7 +53,8 @@ int bitmap_scan(struct bitmap* btmap, uint32_t cnt) {
     uint32_t next_bit = bit_idx_start + 1;
 
     bit_idx_start = -1;
-    while (bit_left-- > 0) {
+    // 起始位之后还剩bit_left - 1位
+    while (--bit_left > 0) {
         if (!(bitmap_scan_test(btmap, next_bit))) {
             ++count;
         } else {
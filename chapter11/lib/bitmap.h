@@ -5,6 +5,15 @@
 
 # define BITMAP_MASK 1
 
+/**
+ * 返回word中最低的为1的位的下标，word不能为0.
+ */
+static inline uint32_t bit_scan_forward(uint32_t word) {
+    uint32_t index;
+    asm ("bsfl %1, %0" : "=r" (index) : "rm" (word) : "cc");
+    return index;
+}
+
 struct bitmap {
     uint32_t btmp_bytes_len;
     uint8_t* bits;
@@ -0,0 +1,241 @@
+# include "avl.h"
+
+static int32_t node_height(struct avl_node* node) {
+    return node == NULL ? 0 : node->height;
+}
+
+/**
+ * 根据左右孩子更新节点的高度和附加信息.
+ */ 
+static void node_update(struct avl_tree* tree, struct avl_node* node) {
+    int32_t left_height = node_height(node->left), right_height = node_height(node->right);
+    node->height = (left_height > right_height ? left_height : right_height) + 1;
+
+    if (tree->augment != NULL) {
+        tree->augment(node);
+    }
+}
+
+/**
+ * 在parent中用new_child替换old_child，parent为NULL时替换根节点.
+ */ 
+static void replace_child(struct avl_tree* tree, struct avl_node* parent, struct avl_node* old_child, struct avl_node* new_child) {
+    if (parent == NULL) {
+        tree->root = new_child;
+    } else if (parent->left == old_child) {
+        parent->left = new_child;
+    } else {
+        parent->right = new_child;
+    }
+
+    if (new_child != NULL) {
+        new_child->parent = parent;
+    }
+}
+
+/**
+ * 以node为轴左旋，返回旋转后子树的根.
+ */ 
+static struct avl_node* rotate_left(struct avl_tree* tree, struct avl_node* node) {
+    struct avl_node* right = node->right;
+
+    replace_child(tree, node->parent, node, right);
+    node->right = right->left;
+    if (right->left != NULL) {
+        right->left->parent = node;
+    }
+    right->left = node;
+    node->parent = right;
+
+    node_update(tree, node);
+    node_update(tree, right);
+    return right;
+}
+
+/**
+ * 以node为轴右旋，返回旋转后子树的根.
+ */ 
+static struct avl_node* rotate_right(struct avl_tree* tree, struct avl_node* node) {
+    struct avl_node* left = node->left;
+
+    replace_child(tree, node->parent, node, left);
+    node->left = left->right;
+    if (left->right != NULL) {
+        left->right->parent = node;
+    }
+    left->right = node;
+    node->parent = left;
+
+    node_update(tree, node);
+    node_update(tree, left);
+    return left;
+}
+
+/**
+ * 恢复以node为根的子树的平衡(左右子树均已平衡)，返回新的子树根.
+ */ 
+static struct avl_node* rebalance(struct avl_tree* tree, struct avl_node* node) {
+    int32_t balance = node_height(node->left) - node_height(node->right);
+
+    if (balance > 1) {
+        if (node_height(node->left->left) < node_height(node->left->right)) {
+            rotate_left(tree, node->left);
+        }
+        return rotate_right(tree, node);
+    }
+
+    if (balance < -1) {
+        if (node_height(node->right->right) < node_height(node->right->left)) {
+            rotate_right(tree, node->right);
+        }
+        return rotate_left(tree, node);
+    }
+
+    node_update(tree, node);
+    return node;
+}
+
+/**
+ * 从node开始一直回溯到根，沿途更新高度、附加信息并恢复平衡.
+ */ 
+static void retrace(struct avl_tree* tree, struct avl_node* node) {
+    while (node != NULL) {
+        node = rebalance(tree, node)->parent;
+    }
+}
+
+void avl_init(struct avl_tree* tree, avl_less* less, avl_augment* augment) {
+    tree->root = NULL;
+    tree->less = less;
+    tree->augment = augment;
+}
+
+/**
+ * 插入节点，键相同的节点排在已有节点之后.
+ */ 
+void avl_insert(struct avl_tree* tree, struct avl_node* node) {
+    struct avl_node* parent = NULL;
+    struct avl_node** link = &tree->root;
+
+    while (*link != NULL) {
+        parent = *link;
+        link = tree->less(node, parent) ? &parent->left : &parent->right;
+    }
+
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->height = 1;
+    *link = node;
+
+    retrace(tree, node);
+}
+
+/**
+ * 删除节点.
+ */ 
+void avl_remove(struct avl_tree* tree, struct avl_node* node) {
+    // 结构发生变化的最低的节点，从这里开始回溯
+    struct avl_node* lowest;
+
+    if (node->left == NULL || node->right == NULL) {
+        lowest = node->parent;
+        replace_child(tree, node->parent, node, (node->left != NULL ? node->left : node->right));
+    } else {
+        // 用后继(右子树中最小的节点)顶替node的位置
+        struct avl_node* successor = node->right;
+        while (successor->left != NULL) {
+            successor = successor->left;
+        }
+
+        if (successor->parent == node) {
+            lowest = successor;
+        } else {
+            lowest = successor->parent;
+            replace_child(tree, successor->parent, successor, successor->right);
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        replace_child(tree, node->parent, node, successor);
+        successor->left = node->left;
+        node->left->parent = successor;
+    }
+
+    retrace(tree, lowest);
+}
+
+/**
+ * 节点的键不变而附加信息依赖的数据发生变化后，更新它及其所有祖先的附加信息.
+ */ 
+void avl_augment_update(struct avl_tree* tree, struct avl_node* node) {
+    if (tree->augment == NULL) {
+        return;
+    }
+
+    while (node != NULL) {
+        tree->augment(node);
+        node = node->parent;
+    }
+}
+
+/**
+ * 键最小的节点，树为空时返回NULL.
+ */ 
+struct avl_node* avl_first(struct avl_tree* tree) {
+    struct avl_node* node = tree->root;
+    while (node != NULL && node->left != NULL) {
+        node = node->left;
+    }
+    return node;
+}
+
+/**
+ * 键最大的节点，树为空时返回NULL.
+ */ 
+struct avl_node* avl_last(struct avl_tree* tree) {
+    struct avl_node* node = tree->root;
+    while (node != NULL && node->right != NULL) {
+        node = node->right;
+    }
+    return node;
+}
+
+/**
+ * 中序遍历的下一个节点，没有时返回NULL.
+ */ 
+struct avl_node* avl_next(struct avl_node* node) {
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL) {
+            node = node->left;
+        }
+        return node;
+    }
+
+    while (node->parent != NULL && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+/**
+ * 中序遍历的上一个节点，没有时返回NULL.
+ */ 
+struct avl_node* avl_prev(struct avl_node* node) {
+    if (node->left != NULL) {
+        node = node->left;
+        while (node->right != NULL) {
+            node = node->right;
+        }
+        return node;
+    }
+
+    while (node->parent != NULL && node == node->parent->left) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+int avl_empty(struct avl_tree* tree) {
+    return tree->root == NULL;
+}
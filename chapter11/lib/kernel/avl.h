@@ -0,0 +1,47 @@
+# ifndef _LIB_KERNEL_AVL_H
+# define _LIB_KERNEL_AVL_H
+
+# include "global.h"
+
+/**
+ * AVL树节点，嵌入到宿主结构体中，通过elem2entry取得宿主.
+ */ 
+struct avl_node {
+    struct avl_node* parent;
+    struct avl_node* left;
+    struct avl_node* right;
+    // 以此节点为根的子树高度，叶子为1
+    int32_t height;
+};
+
+/**
+ * 节点a的键是否小于节点b.
+ */ 
+typedef int (avl_less) (struct avl_node* a, struct avl_node* b);
+
+/**
+ * 根据节点自身及其左右孩子重新计算节点上附加的子树信息(如子树中的最大值)，孩子的信息已经是最新的.
+ */ 
+typedef void (avl_augment) (struct avl_node* node);
+
+/**
+ * AVL树，不加锁，由使用者保证互斥.
+ */ 
+struct avl_tree {
+    struct avl_node* root;
+    avl_less* less;
+    // 可为NULL
+    avl_augment* augment;
+};
+
+void avl_init(struct avl_tree* tree, avl_less* less, avl_augment* augment);
+void avl_insert(struct avl_tree* tree, struct avl_node* node);
+void avl_remove(struct avl_tree* tree, struct avl_node* node);
+void avl_augment_update(struct avl_tree* tree, struct avl_node* node);
+struct avl_node* avl_first(struct avl_tree* tree);
+struct avl_node* avl_last(struct avl_tree* tree);
+struct avl_node* avl_next(struct avl_node* node);
+struct avl_node* avl_prev(struct avl_node* node);
+int avl_empty(struct avl_tree* tree);
+
+# endif
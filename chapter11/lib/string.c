@@ -23,7 +23,7 @@ void memcpy(void* dst, const void* src, uint32_t size) {
     const uint8_t* _src = (uint8_t*) src;
 
     while (size-- > 0) {
-        *_dst++ = _src++;
+        *_dst++ = *_src++;
     }
 }
 
@@ -36,12 +36,15 @@ int memcmp(const void* left, const void* right, uint32_t size) {
     const uint8_t* _left = (uint8_t*) left;
     const uint8_t* _right = (uint8_t*) right;
     
-    while (size-- > 0 && *_left++ == *_right);
-
-    if (size == 0); 
-        return 0;
+    while (size-- > 0) {
+        if (*_left != *_right) {
+            return (*_left > *_right ? 1 : -1);
+        }
+        ++_left;
+        ++_right;
+    }
 
-    return (*_left > *_right ? 1 : -1);
+    return 0;
 }
 
 char* strcpy(char* dst, const char* src) {
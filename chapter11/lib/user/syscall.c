@@ -0,0 +1,31 @@
+# include "syscall.h"
+
+/**
+ * 无参数的系统调用，返回值由eax带回.
+ */ 
+# define _syscall0(NUMBER) ({ \
+    int retval; \
+    asm volatile ("int $0x80" : "=a" (retval) : "a" (NUMBER) : "memory"); \
+    retval; \
+})
+
+/**
+ * 返回当前任务的pid.
+ */ 
+uint32_t getpid(void) {
+    return _syscall0(SYS_GETPID);
+}
+
+/**
+ * 创建子进程，父进程中返回子进程的pid，子进程中返回0，失败返回-1.
+ */ 
+pid_t fork(void) {
+    return _syscall0(SYS_FORK);
+}
+
+/**
+ * 结束当前进程，释放其全部内存，不再返回.
+ */ 
+void exit(void) {
+    _syscall0(SYS_EXIT);
+}
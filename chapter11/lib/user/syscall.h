@@ -0,0 +1,20 @@
+# ifndef _LIB_USER_SYSCALL_H
+# define _LIB_USER_SYSCALL_H
+
+# include "stdint.h"
+# include "thread/thread.h"
+
+/**
+ * 系统调用子功能号.
+ */ 
+enum SYSCALL_NR {
+    SYS_GETPID,
+    SYS_FORK,
+    SYS_EXIT
+};
+
+uint32_t getpid(void);
+pid_t fork(void);
+void exit(void);
+
+# endif
@@ -32,6 +32,7 @@ total_memory_bytes dd 0
 gdt_ptr dw GDT_LIMIT
         dd GDT_BASE
 
+; 完整的内存布局(ARDS)，内核据此建立内存池，此处的内存地址是0xb0a
 ards_buf times 244 db 0
 ards_nr dw 0
 
@@ -50,9 +51,14 @@ loader_start:
     
     add di, cx
     inc word [ards_nr]
+    ; ards_buf最多容纳12个描述符，再多会覆盖ards_nr及其后的代码
+    cmp word [ards_nr], 12
+    jae .e820_mem_get_done
     cmp ebx, 0
     jnz .e820_mem_get_loop
 
+.e820_mem_get_done:
+
     mov cx, [ards_nr]
     mov ebx, ards_buf
     xor edx, edx
@@ -62,7 +68,7 @@ loader_start:
     add eax, [ebx + 8]
     add ebx, 20
     cmp edx, eax
-    jge .next_ards
+    jae .next_ards
     mov edx, eax
 
 .next_ards:
@@ -134,6 +140,11 @@ p_mode_start:
     mov eax, PAGE_DIR_TABLE_POS
     mov cr3, eax
 
+    ; 打开4MB大页和全局页支持
+    mov eax, cr4
+    or eax, CR4_PSE | CR4_PGE
+    mov cr4, eax
+
     ; 打开分页
     mov eax, cr0
     or eax, 0x80000000
@@ -163,43 +174,22 @@ setup_page:
 
 ; 创建页目录表(PDE)
 .create_pde:
-    mov eax, PAGE_DIR_TABLE_POS
-    ; 0x1000为4KB，加上页目录表起始地址便是第一个页表的地址
-    add eax, 0x1000
-    mov ebx, eax
-
-    ; 设置页目录项属性
-    or eax, PG_US_U | PG_RW_W | PG_P
+    ; 低端4MB使用一个4MB的大页映射，不再需要页表; 只允许特权级0访问
+    mov eax, PG_PS | PG_US_S | PG_RW_W | PG_P
     ; 设置第一个页目录项
     mov [PAGE_DIR_TABLE_POS], eax
-    ; 第768(内核空间的第一个)个页目录项，与第一个相同，这样第一个和768个都指向低端4MB空间
+    ; 第768(内核空间的第一个)个页目录项，与第一个指向同样的低端4MB空间，
+    ; 内核空间为所有进程共享，标记为全局页; 第一项只存在于内核页目录中，不能是全局的
+    ; 内核初始化内存池时会换成4KB的页表，只让用户进程访问内核映像
+    or eax, PG_G
     mov [PAGE_DIR_TABLE_POS + 0xc00], eax
-    ; 最后一个表项指向自己，用于访问页目录本身
-    sub eax, 0x1000
-    mov [PAGE_DIR_TABLE_POS + 4092], eax
 
-; 创建页表
-    mov ecx, 256
-    mov esi, 0
-    mov edx, PG_US_U | PG_RW_W | PG_P
-.create_pte:
-    mov [ebx + esi * 4], edx
-    add edx, 4096
-    inc esi
-    loop .create_pte
-
-; 创建内核的其它PDE
+    ; 最后一个表项指向自己，用于访问页目录本身，只允许特权级0访问
     mov eax, PAGE_DIR_TABLE_POS
-    add eax, 0x2000
-    or eax, PG_US_U | PG_RW_W | PG_P
-    mov ebx, PAGE_DIR_TABLE_POS
-    mov ecx, 254
-    mov esi, 769
-.create_kernel_pde:
-    mov [ebx + esi * 4], eax
-    inc esi
-    add eax, 0x1000
-    loop .create_kernel_pde
+    or eax, PG_US_S | PG_RW_W | PG_P
+    mov [PAGE_DIR_TABLE_POS + 4092], eax
+
+; 内核其它的页表由内核在初始化内存池时按实际需要创建
     ret
 
 ; 保护模式的硬盘读取函数
@@ -0,0 +1,92 @@
+# include "fork.h"
+# include "process.h"
+# include "memory.h"
+# include "interrupt.h"
+# include "debug.h"
+# include "global.h"
+# include "string.h"
+# include "thread/thread.h"
+
+extern void intr_exit(void);
+
+/**
+ * 复制父进程的PCB(连同其0特权级栈)和虚拟内存区域给子进程.
+ */ 
+static int32_t copy_pcb_vm_space_stack0(struct task_struct* child_thread, struct task_struct* parent_thread) {
+    memcpy(child_thread, parent_thread, PAGE_SIZE);
+    // 页目录稍后单独创建，失败时不能把父进程的页目录当成子进程的释放
+    child_thread->pgdir = NULL;
+
+    child_thread->pid = fork_pid();
+    child_thread->runtime_cycles = 0;
+    child_thread->status = TASK_READY;
+    child_thread->ticks = child_thread->priority;
+    child_thread->general_tag.prev = child_thread->general_tag.next = NULL;
+    child_thread->all_list_tag.prev = child_thread->all_list_tag.next = NULL;
+
+    return vm_space_copy(&child_thread->vm_space, &parent_thread->vm_space);
+}
+
+/**
+ * 构建子进程的内核栈，使其第一次被调度时经intr_exit直接返回用户态，且fork的返回值为0.
+ */ 
+static void build_child_stack(struct task_struct* child_thread) {
+    // 系统调用进入内核时保存的用户态上下文位于PCB的顶端
+    struct intr_stack* intr_0_stack = (struct intr_stack*) ((uint32_t) child_thread + PAGE_SIZE - sizeof(struct intr_stack));
+    intr_0_stack->eax = 0;
+
+    // switch_to依次弹出ebp、ebx、edi、esi，随后ret到intr_exit
+    uint32_t* ret_addr_in_thread_stack = (uint32_t*) intr_0_stack - 1;
+    uint32_t* ebp_ptr_in_thread_stack = (uint32_t*) intr_0_stack - 5;
+
+    *ret_addr_in_thread_stack = (uint32_t) intr_exit;
+    child_thread->self_kstack = ebp_ptr_in_thread_stack;
+}
+
+/**
+ * fork系统调用: 子进程与父进程以写时复制的方式共享用户空间，只复制页表.
+ */ 
+pid_t sys_fork(void) {
+    struct task_struct* parent_thread = running_thread();
+    // 内核线程没有自己的用户空间
+    if (parent_thread->pgdir == NULL) {
+        return -1;
+    }
+
+    struct task_struct* child_thread = pcb_alloc();
+    if (child_thread == NULL) {
+        return -1;
+    }
+
+    ASSERT(intr_get_status() == INTR_OFF);
+
+    if (copy_pcb_vm_space_stack0(child_thread, parent_thread) == -1) {
+        goto fail;
+    }
+
+    child_thread->pgdir = create_page_dir();
+    if (child_thread->pgdir == NULL) {
+        goto fail;
+    }
+
+    if (copy_user_page_tables(child_thread->pgdir) == -1) {
+        goto fail;
+    }
+    build_child_stack(child_thread);
+
+    thread_ready(child_thread);
+
+    ASSERT(!list_find(&thread_all_list, &child_thread->all_list_tag));
+    list_append(&thread_all_list, &child_thread->all_list_tag);
+
+    return child_thread->pid;
+
+fail:
+    // vm_space_copy失败时已清空子进程的区域树，再次释放无害
+    vm_space_destroy(&child_thread->vm_space);
+    if (child_thread->pgdir != NULL) {
+        page_dir_free(child_thread->pgdir);
+    }
+    pcb_free(child_thread);
+    return -1;
+}
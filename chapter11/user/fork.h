@@ -0,0 +1,8 @@
+# ifndef _USER_FORK_H
+# define _USER_FORK_H
+
+# include "thread/thread.h"
+
+pid_t sys_fork(void);
+
+# endif
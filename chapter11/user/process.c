@@ -5,6 +5,10 @@
 # include "debug.h"
 # include "tss.h"
 # include "thread/thread.h"
+# include "string.h"
+
+// 缓存的页目录个数上限
+# define PGDIR_CACHE_MAX 16
 
 extern void intr_exit(void);
 
@@ -30,24 +34,35 @@ void start_process(void* filename) {
     proc_stack->eip = function;
     proc_stack->cs = SELECTOR_U_CODE;
     proc_stack->eflags = (EFLAGS_IOPL_0 | EFLAGS_MBS | EFLAGS_IF_1);
-    proc_stack->esp = (void*) ((uint32_t) get_a_page(PF_USER, USER_STACK3_VADDR) + PAGE_SIZE);
+    // 用户栈不预先分配，第一次压栈时由缺页中断建立映射
+    proc_stack->esp = (void*) (USER_STACK3_VADDR + PAGE_SIZE);
     proc_stack->ss = SELECTOR_U_DATA;
 
     asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (proc_stack) : "memory");
 }
 
+// 当前CR3中的页目录物理地址，初始为loader建立的内核页目录
+static uint32_t loaded_page_dir = 0x100000;
+// 已退出进程的页目录，用户部分已清空，内核部分和指向自身的最后一项仍然有效，新进程直接复用
+static uint32_t* pgdir_cache[PGDIR_CACHE_MAX];
+static uint32_t pgdir_cache_count;
+
 /**
- * 如果给定的PCB是进程，那么将其页表设置到CR3.
+ * 如果给定的PCB是进程，那么将其页表设置到CR3. 内核空间为所有页目录共享，
+ * 所以内核线程可以沿用上一个任务的页目录，只有在需要不同的用户空间时才重新加载CR3(同时会刷新TLB).
  */ 
 void page_dir_activate(struct task_struct* pthread) {
-    // 内核页表的物理地址，定义在boot.inc，进入保护模式时确定
-    uint32_t page_phy_dir = 0x100000;
+    if (pthread->pgdir == NULL) {
+        return;
+    }
 
-    if (pthread->pgdir != NULL) {
-        // 进程，得到其页表地址
-        page_phy_dir = addr_v2p((uint32_t) pthread->pgdir);
+    // 进程，得到其页表地址
+    uint32_t page_phy_dir = addr_v2p((uint32_t) pthread->pgdir);
+    if (page_phy_dir == loaded_page_dir) {
+        return;
     }
 
+    loaded_page_dir = page_phy_dir;
     asm volatile ("movl %0, %%cr3" : : "r" (page_phy_dir) : "memory");
 }
 
@@ -65,57 +80,98 @@ void process_activate(struct task_struct* pthread) {
 }
 
 /**
- * 为进程创建页目录表.
+ * 为进程创建页目录表，内存不足时返回NULL.
  */ 
 uint32_t* create_page_dir(void) {
+    enum intr_status old_status = intr_disable();
+    if (pgdir_cache_count > 0) {
+        uint32_t* page_dir_vaddr = pgdir_cache[--pgdir_cache_count];
+        intr_set_status(old_status);
+        return page_dir_vaddr;
+    }
+    intr_set_status(old_status);
+
     uint32_t* page_dir_vaddr = get_kernel_pages(1);
     if (page_dir_vaddr == NULL) {
-        PANIC("create_page_dir: get_kernel_pages failed!");
         return NULL;
     }
 
     // 将内核的页表复制到进程页目录项中，实现内核的共享
     memcpy((uint32_t*) ((uint32_t) page_dir_vaddr + 0x300 * 4), (uint32_t*) (0xfffff000 + 0x300 * 4), 1024);
 
-    // 设置最后一项页表的地址为页目录地址
+    // 设置最后一项页表的地址为页目录地址，用户态不能经此改写自己的页表
     uint32_t new_page_dir_phy_addr = addr_v2p((uint32_t) page_dir_vaddr);
-    page_dir_vaddr[1023] = (new_page_dir_phy_addr | PG_US_U | PG_RW_W | PG_P_1);
+    page_dir_vaddr[1023] = (new_page_dir_phy_addr | PG_US_S | PG_RW_W | PG_P_1);
     
     return page_dir_vaddr;
 }
 
 /**
- * 为用户进程设置其单独的虚拟地址池.
+ * 回收用户空间已清空的页目录表，缓存未满时留给下一个进程使用.
+ */ 
+void page_dir_free(uint32_t* pgdir) {
+    enum intr_status old_status = intr_disable();
+    if (pgdir_cache_count < PGDIR_CACHE_MAX) {
+        pgdir_cache[pgdir_cache_count++] = pgdir;
+    } else {
+        mfree_page(PF_KERNEL, pgdir, 1);
+    }
+    intr_set_status(old_status);
+}
+
+/**
+ * 释放当前进程的用户空间和虚拟内存区域，并回收其页目录，此后当前任务只剩内核部分，如同内核线程.
  */ 
-void create_user_vaddr_bitmap(struct task_struct* user_process) {
-    user_process->userprog_addr.vaddr_start = USER_VADDR_START;
-    // 0xc0000000是内核虚拟地址起始处
-    uint32_t bitmap_page_count = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PAGE_SIZE / 8, PAGE_SIZE);
+void process_release(struct task_struct* pthread) {
+    ASSERT(pthread == running_thread() && pthread->pgdir != NULL);
 
-    user_process->userprog_addr.vaddr_bitmap.bits = get_kernel_pages(bitmap_page_count);
-    user_process->userprog_addr.vaddr_bitmap.btmp_bytes_len = (0xc0000000 - USER_VADDR_START) / PAGE_SIZE / 8;
+    user_space_release();
+    vm_space_destroy(&pthread->vm_space);
+
+    enum intr_status old_status = intr_disable();
+    // 页目录可能马上分给新进程，CR3中若仍是它，新进程激活时会因地址相同跳过加载，TLB中残留着本进程的表项
+    loaded_page_dir = 0x100000;
+    asm volatile ("movl %0, %%cr3" : : "r" (loaded_page_dir) : "memory");
 
-    bitmap_init(&user_process->userprog_addr.vaddr_bitmap);
+    uint32_t* pgdir = pthread->pgdir;
+    pthread->pgdir = NULL;
+    page_dir_free(pgdir);
+    intr_set_status(old_status);
+}
+
+/**
+ * 为用户进程设置其单独的虚拟地址空间，此时没有任何区域，栈在第一次访问时建立.
+ */ 
+void create_user_vm_space(struct task_struct* user_process) {
+    // 0xc0000000是内核虚拟地址起始处，其下留给栈增长的区域不参与分配
+    vm_space_init(&user_process->vm_space, USER_VADDR_START, 0xc0000000 - USER_STACK_MAX_SIZE, 0xc0000000);
 }
 
 /**
  * 创建用户进程.
  */ 
 void process_execute(void* filename, char* name) {
-    struct task_struct* pcb = get_kernel_pages(1);
-    
+    struct task_struct* pcb = pcb_alloc();
+    if (pcb == NULL) {
+        return;
+    }
+
     init_thread(pcb, name, default_prio);
 
-    create_user_vaddr_bitmap(pcb);
+    create_user_vm_space(pcb);
 
     thread_create(pcb, start_process, filename);
 
     pcb->pgdir = create_page_dir();
+    if (pcb->pgdir == NULL) {
+        // 地址空间中还没有区域，只需归还PCB
+        pcb_free(pcb);
+        return;
+    }
 
     enum intr_status old_status = intr_disable();
 
-    ASSERT(!list_find(&thread_ready_list, &pcb->general_tag));
-    list_append(&thread_ready_list, &pcb->general_tag);
+    thread_ready(pcb);
 
     ASSERT(!list_find(&thread_all_list, &pcb->all_list_tag));
     list_append(&thread_all_list, &pcb->all_list_tag);
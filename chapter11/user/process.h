@@ -5,13 +5,18 @@
 # define _USER_PROCESS_H
 
 # define USER_STACK3_VADDR (0xc0000000 - 0x1000)
+// 用户栈可以自动向下增长的最大长度
+# define USER_STACK_MAX_SIZE 0x800000
 # define USER_VADDR_START 0x8048000
 # define default_prio 31
 
 void start_process(void* filename);
 void page_dir_activate(struct task_struct* pthread);
 void process_activate(struct task_struct* pthread);
-void create_user_vaddr_bitmap(struct task_struct* user_process);
+void create_user_vm_space(struct task_struct* user_process);
+uint32_t* create_page_dir(void);
+void page_dir_free(uint32_t* pgdir);
+void process_release(struct task_struct* pthread);
 void process_execute(void* filename, char* name);
 
 # endif
\ No newline at end of file
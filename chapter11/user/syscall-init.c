@@ -0,0 +1,28 @@
+# include "syscall-init.h"
+# include "user/syscall.h"
+# include "stdint.h"
+# include "kernel/print.h"
+# include "thread/thread.h"
+# include "fork.h"
+
+// 与kernel.asm中的SYSCALL_NR一致
+# define syscall_nr 32
+
+typedef void* syscall;
+
+/**
+ * 系统调用表，下标为子功能号.
+ */ 
+syscall syscall_table[syscall_nr];
+
+uint32_t sys_getpid(void) {
+    return running_thread()->pid;
+}
+
+void syscall_init(void) {
+    put_str("syscall_init start.\n");
+    syscall_table[SYS_GETPID] = sys_getpid;
+    syscall_table[SYS_FORK] = sys_fork;
+    syscall_table[SYS_EXIT] = thread_exit;
+    put_str("syscall_init done.\n");
+}
@@ -0,0 +1,9 @@
+# ifndef _USER_SYSCALL_INIT_H
+# define _USER_SYSCALL_INIT_H
+
+# include "stdint.h"
+
+void syscall_init(void);
+uint32_t sys_getpid(void);
+
+# endif